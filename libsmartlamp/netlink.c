@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+
+#include "smartlamp.h"
+#include "smartlamp_genl.h" // familia netlink do driver
+
+#define NL_BUF_SIZE 32768   // o kernel junta varias mensagens do dump em ate 32 KiB
+#define NL_REQ_SIZE 128     // os pedidos tem no maximo dois atributos
+
+// os estados da API seguem os do driver
+_Static_assert((int)SMARTLAMP_LAMP_ONLINE == (int)SMARTLAMP_STATE_ONLINE &&
+               (int)SMARTLAMP_LAMP_OFFLINE == (int)SMARTLAMP_STATE_OFFLINE &&
+               (int)SMARTLAMP_LAMP_RECOVERING == (int)SMARTLAMP_STATE_RECOVERING, "estados diferentes do driver");
+
+struct smartlamp_nl {
+    int fd;
+    uint16_t family;        // id da familia "smartlamp", descoberto pelo controlador genl
+    uint32_t seq;
+    char buf[NL_BUF_SIZE];
+};
+
+// Pedido generic netlink sendo montado
+struct nl_req {
+    struct nlmsghdr hdr;
+    struct genlmsghdr genl;
+    char attrs[NL_REQ_SIZE];
+};
+
+// --- Montagem e envio ---
+
+static void req_init(struct nl_req *req, uint16_t type, uint16_t flags, uint8_t cmd, uint8_t version) {
+    memset(req, 0, sizeof(*req));
+    req->hdr.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    req->hdr.nlmsg_type = type;
+    req->hdr.nlmsg_flags = NLM_F_REQUEST | flags;
+    req->genl.cmd = cmd;
+    req->genl.version = version;
+}
+
+static void req_put(struct nl_req *req, uint16_t type, const void *data, uint16_t len) {
+    struct nlattr *attr = (struct nlattr *)((char *)req + NLMSG_ALIGN(req->hdr.nlmsg_len));
+
+    attr->nla_type = type;
+    attr->nla_len = NLA_HDRLEN + len;
+    memcpy((char *)attr + NLA_HDRLEN, data, len);
+    req->hdr.nlmsg_len = NLMSG_ALIGN(req->hdr.nlmsg_len) + NLA_ALIGN(attr->nla_len);
+}
+
+static void req_put_u32(struct nl_req *req, uint16_t type, uint32_t value) {
+    req_put(req, type, &value, sizeof(value));
+}
+
+// Envia o pedido para o kernel, retorna o seq usado ou -errno
+static int req_send(struct smartlamp_nl *nl, struct nl_req *req) {
+    struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+
+    if (++nl->seq > INT32_MAX) nl->seq = 1; // o seq eh retornado como int positivo
+    req->hdr.nlmsg_seq = nl->seq;
+    if (sendto(nl->fd, req, req->hdr.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) return -errno;
+    return (int)nl->seq;
+}
+
+// --- Decodificacao ---
+
+// Separa os atributos de primeiro nivel em tb[tipo], ignorando os desconhecidos
+static void parse_attrs(const void *data, int len, const struct nlattr **tb, int max) {
+    const struct nlattr *attr = data;
+
+    memset(tb, 0, (max + 1) * sizeof(*tb));
+    while (len >= NLA_HDRLEN && attr->nla_len >= NLA_HDRLEN && attr->nla_len <= len) {
+        int type = attr->nla_type & NLA_TYPE_MASK;
+
+        if (type <= max) tb[type] = attr;
+        len -= NLA_ALIGN(attr->nla_len);
+        attr = (const struct nlattr *)((const char *)attr + NLA_ALIGN(attr->nla_len));
+    }
+}
+
+static const void *attr_data(const struct nlattr *attr) {
+    return (const char *)attr + NLA_HDRLEN;
+}
+
+static uint32_t attr_u32(const struct nlattr *attr) {
+    uint32_t value;
+
+    memcpy(&value, attr_data(attr), sizeof(value));
+    return value;
+}
+
+static uint64_t attr_u64(const struct nlattr *attr) {
+    uint64_t value;
+
+    memcpy(&value, attr_data(attr), sizeof(value));
+    return value;
+}
+
+// Converte uma mensagem SAMPLE, LED ou STATE do driver. Retorna 0, ou -1 se estiver incompleta.
+static int parse_event(const struct nlmsghdr *hdr, struct smartlamp_event *event) {
+    const struct genlmsghdr *genl = NLMSG_DATA(hdr);
+    const struct nlattr *tb[SMARTLAMP_ATTR_MAX + 1];
+    int len = (int)hdr->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+    if (len < 0) return -1;
+    parse_attrs((const char *)genl + GENL_HDRLEN, len, tb, SMARTLAMP_ATTR_MAX);
+    if (!tb[SMARTLAMP_ATTR_LAMP]) return -1;
+
+    memset(event, 0, sizeof(*event));
+    event->lamp = attr_u32(tb[SMARTLAMP_ATTR_LAMP]);
+    event->seq = hdr->nlmsg_pid ? hdr->nlmsg_seq : 0; // os avisos do grupo tem pid 0
+
+    switch (genl->cmd) {
+    case SMARTLAMP_CMD_SAMPLE:
+        if (!tb[SMARTLAMP_ATTR_SENSOR] || !tb[SMARTLAMP_ATTR_VALUE] || !tb[SMARTLAMP_ATTR_SCALE]) return -1;
+        event->type = SMARTLAMP_EVENT_SAMPLE;
+        event->sample.lamp = event->lamp;
+        event->sample.sensor = attr_u32(tb[SMARTLAMP_ATTR_SENSOR]);
+        event->sample.raw = (int32_t)attr_u32(tb[SMARTLAMP_ATTR_VALUE]);
+        event->sample.scale = attr_u32(tb[SMARTLAMP_ATTR_SCALE]);
+        if (tb[SMARTLAMP_ATTR_TIME_NS]) event->sample.host_ns = attr_u64(tb[SMARTLAMP_ATTR_TIME_NS]);
+        return 0;
+    case SMARTLAMP_CMD_LED:
+        if (!tb[SMARTLAMP_ATTR_LED]) return -1;
+        event->type = SMARTLAMP_EVENT_LED;
+        event->led = attr_u32(tb[SMARTLAMP_ATTR_LED]);
+        return 0;
+    case SMARTLAMP_CMD_STATE:
+        if (!tb[SMARTLAMP_ATTR_STATE]) return -1;
+        event->type = SMARTLAMP_EVENT_STATE;
+        event->state = attr_u32(tb[SMARTLAMP_ATTR_STATE]);
+        return 0;
+    }
+    return -1;
+}
+
+// --- Descoberta da familia ---
+
+// Pergunta ao controlador genl o id da familia "smartlamp" e do grupo "events"
+static int resolve_family(struct smartlamp_nl *nl, uint32_t *group) {
+    const struct nlattr *tb[CTRL_ATTR_MAX + 1], *grp[CTRL_ATTR_MCAST_GRP_MAX + 1];
+    const struct nlattr *entry;
+    const struct nlmsghdr *hdr;
+    struct nl_req req;
+    int len, left;
+
+    req_init(&req, GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY, 1);
+    req_put(&req, CTRL_ATTR_FAMILY_NAME, SMARTLAMP_GENL_NAME, sizeof(SMARTLAMP_GENL_NAME));
+    len = req_send(nl, &req);
+    if (len < 0) return len;
+
+    len = recv(nl->fd, nl->buf, sizeof(nl->buf), 0);
+    if (len < 0) return -errno;
+    hdr = (const struct nlmsghdr *)nl->buf;
+    if (!NLMSG_OK(hdr, (unsigned int)len)) return -EPROTO;
+    if (hdr->nlmsg_type == NLMSG_ERROR) {
+        const struct nlmsgerr *err = NLMSG_DATA(hdr);
+        return err->error ? err->error : -EPROTO; // -ENOENT: driver nao carregado
+    }
+
+    parse_attrs((const char *)NLMSG_DATA(hdr) + GENL_HDRLEN, hdr->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+                tb, CTRL_ATTR_MAX);
+    if (!tb[CTRL_ATTR_FAMILY_ID] || !tb[CTRL_ATTR_MCAST_GROUPS]) return -EPROTO;
+    memcpy(&nl->family, attr_data(tb[CTRL_ATTR_FAMILY_ID]), sizeof(nl->family));
+
+    // CTRL_ATTR_MCAST_GROUPS eh uma lista de grupos, cada um com nome e id
+    entry = attr_data(tb[CTRL_ATTR_MCAST_GROUPS]);
+    left = tb[CTRL_ATTR_MCAST_GROUPS]->nla_len - NLA_HDRLEN;
+    while (left >= NLA_HDRLEN && entry->nla_len >= NLA_HDRLEN && entry->nla_len <= left) {
+        parse_attrs(attr_data(entry), entry->nla_len - NLA_HDRLEN, grp, CTRL_ATTR_MCAST_GRP_MAX);
+        if (grp[CTRL_ATTR_MCAST_GRP_NAME] && grp[CTRL_ATTR_MCAST_GRP_ID] &&
+            !strcmp(attr_data(grp[CTRL_ATTR_MCAST_GRP_NAME]), SMARTLAMP_GENL_MCGRP)) {
+            *group = attr_u32(grp[CTRL_ATTR_MCAST_GRP_ID]);
+            return 0;
+        }
+        left -= NLA_ALIGN(entry->nla_len);
+        entry = (const struct nlattr *)((const char *)entry + NLA_ALIGN(entry->nla_len));
+    }
+    return -EPROTO;
+}
+
+// --- API ---
+
+struct smartlamp_nl *smartlamp_nl_open(void) {
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+    struct smartlamp_nl *nl;
+    uint32_t group;
+    int ret;
+
+    nl = calloc(1, sizeof(*nl));
+    if (!nl) return NULL;
+
+    nl->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (nl->fd < 0 || bind(nl->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) goto err;
+
+    ret = resolve_family(nl, &group);
+    if (ret < 0) {
+        errno = -ret;
+        goto err;
+    }
+    if (setsockopt(nl->fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) goto err;
+    return nl;
+
+err:
+    ret = errno;
+    smartlamp_nl_close(nl);
+    errno = ret;
+    return NULL;
+}
+
+void smartlamp_nl_close(struct smartlamp_nl *nl) {
+    if (!nl) return;
+    if (nl->fd >= 0) close(nl->fd);
+    free(nl);
+}
+
+int smartlamp_nl_fd(const struct smartlamp_nl *nl) {
+    return nl->fd;
+}
+
+int smartlamp_nl_recv(struct smartlamp_nl *nl, struct smartlamp_event *out, int max) {
+    const struct nlmsghdr *hdr;
+    int len, count = 0;
+
+    len = recv(nl->fd, nl->buf, sizeof(nl->buf), 0);
+    if (len < 0) return -errno;
+
+    for (hdr = (const struct nlmsghdr *)nl->buf; NLMSG_OK(hdr, (unsigned int)len); hdr = NLMSG_NEXT(hdr, len)) {
+        struct smartlamp_event event;
+
+        if (hdr->nlmsg_type == NLMSG_ERROR || hdr->nlmsg_type == NLMSG_DONE) {
+            // ACK (error = 0) ou erro de um pedido; o fim de um dump tambem termina o pedido
+            memset(&event, 0, sizeof(event));
+            event.type = SMARTLAMP_EVENT_ACK;
+            event.lamp = -1;
+            event.seq = hdr->nlmsg_seq;
+            if (hdr->nlmsg_type == NLMSG_ERROR) event.error = ((const struct nlmsgerr *)NLMSG_DATA(hdr))->error;
+        } else if (hdr->nlmsg_type != nl->family || parse_event(hdr, &event)) {
+            continue;
+        }
+        if (count < max) out[count++] = event;
+    }
+    return count;
+}
+
+int smartlamp_nl_request_samples(struct smartlamp_nl *nl) {
+    struct nl_req req;
+
+    req_init(&req, nl->family, NLM_F_DUMP, SMARTLAMP_CMD_GET_SAMPLES, SMARTLAMP_GENL_VERSION);
+    return req_send(nl, &req);
+}
+
+int smartlamp_nl_request_sensor(struct smartlamp_nl *nl, int lamp, int sensor) {
+    struct nl_req req;
+
+    if (lamp < 0 || sensor < 0 || sensor >= SMARTLAMP_SENSOR_COUNT) return -EINVAL;
+    req_init(&req, nl->family, NLM_F_ACK, SMARTLAMP_CMD_GET_SENSOR, SMARTLAMP_GENL_VERSION);
+    req_put_u32(&req, SMARTLAMP_ATTR_LAMP, lamp);
+    req_put_u32(&req, SMARTLAMP_ATTR_SENSOR, sensor);
+    return req_send(nl, &req);
+}
+
+int smartlamp_nl_request_led(struct smartlamp_nl *nl, int lamp) {
+    struct nl_req req;
+
+    if (lamp < 0) return -EINVAL;
+    req_init(&req, nl->family, NLM_F_ACK, SMARTLAMP_CMD_GET_LED, SMARTLAMP_GENL_VERSION);
+    req_put_u32(&req, SMARTLAMP_ATTR_LAMP, lamp);
+    return req_send(nl, &req);
+}
+
+int smartlamp_nl_set_led(struct smartlamp_nl *nl, int lamp, int value) {
+    struct nl_req req;
+
+    if (lamp < 0 || value < 0) return -EINVAL;
+    req_init(&req, nl->family, NLM_F_ACK, SMARTLAMP_CMD_SET_LED, SMARTLAMP_GENL_VERSION);
+    req_put_u32(&req, SMARTLAMP_ATTR_LAMP, lamp);
+    req_put_u32(&req, SMARTLAMP_ATTR_LED, value);
+    return req_send(nl, &req);
+}
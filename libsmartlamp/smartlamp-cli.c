@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smartlamp.h"
+
+#define MAX_SAMPLES (SMARTLAMP_MAX_LAMPS * SMARTLAMP_SENSOR_COUNT)
+
+static void usage(void) {
+    fprintf(stderr,
+            "uso: smartlamp-cli [-r raiz] <comando>\n"
+            "  list                                   lampadas e ultimas amostras\n"
+            "  get <lampada> <led|ldr|temp|hum>       le o LED ou um sensor\n"
+            "  set <lampada> <brilho>                 altera o LED (0 a 100)\n"
+            "  group <lampada>=<brilho> ...           altera varias lampadas juntas\n"
+            "  events <lampada> <sensor> <delta> [<limite> <histerese>]\n"
+            "                                         configura os avisos de um sensor\n"
+            "  poll <lampada> <ms>                    leituras periodicas pelo driver (0 desliga)\n"
+            "  batch <lampada> <ms> [registros]       lotes de leituras do firmware (0 desliga)\n"
+            "  watch [timeout_ms]                     mostra as amostras avisadas por todas as lampadas\n"
+            "  monitor                                amostras e mudancas de estado pelo netlink\n");
+    exit(2);
+}
+
+static int parse_int(const char *text, int *value) {
+    char *end;
+    long v = strtol(text, &end, 10);
+
+    if (end == text || *end) return -1;
+    *value = (int)v;
+    return 0;
+}
+
+// "0.5" -> 50 com escala 100
+static int parse_fixed(const char *text, int32_t scale, int32_t *value) {
+    char *end;
+    double v = strtod(text, &end);
+
+    if (end == text || *end) return -1;
+    *value = (int32_t)(v * scale + (v < 0 ? -0.5 : 0.5));
+    return 0;
+}
+
+static void print_sample(const struct smartlamp_sample *sample) {
+    printf("lamp%d %s %.*f %llu\n", sample->lamp, smartlamp_sensor_name(sample->sensor),
+           sample->scale >= 100 ? 2 : 0, smartlamp_sample_value(sample),
+           (unsigned long long)sample->host_ns);
+}
+
+static int fail(const char *what, int err) {
+    fprintf(stderr, "smartlamp-cli: %s: %s\n", what, strerror(-err));
+    return 1;
+}
+
+static int cmd_list(struct smartlamp_ctx *ctx) {
+    struct smartlamp_sample samples[MAX_SAMPLES];
+    int ids[SMARTLAMP_MAX_LAMPS];
+    int i, n;
+
+    n = smartlamp_lamps(ctx, ids, SMARTLAMP_MAX_LAMPS);
+    for (i = 0; i < n; i++) printf("lamp%d\n", ids[i]);
+
+    n = smartlamp_read_all(ctx, samples, MAX_SAMPLES);
+    for (i = 0; i < n; i++) print_sample(&samples[i]);
+    return 0;
+}
+
+static int cmd_get(struct smartlamp_ctx *ctx, int argc, char **argv) {
+    struct smartlamp_sample sample;
+    int lamp, sensor, ret;
+
+    if (argc != 2 || parse_int(argv[0], &lamp)) usage();
+    if (!strcmp(argv[1], "led")) {
+        ret = smartlamp_get_led(ctx, lamp);
+        if (ret < 0) return fail("led", ret);
+        printf("%d\n", ret);
+        return 0;
+    }
+
+    sensor = smartlamp_sensor_from_name(argv[1]);
+    if (sensor < 0) usage();
+    ret = smartlamp_read_sensor(ctx, lamp, sensor, &sample);
+    if (ret < 0) return fail(argv[1], ret);
+    print_sample(&sample);
+    return 0;
+}
+
+static int cmd_set(struct smartlamp_ctx *ctx, int argc, char **argv) {
+    int lamp, value, ret;
+
+    if (argc != 2 || parse_int(argv[0], &lamp) || parse_int(argv[1], &value)) usage();
+    ret = smartlamp_set_led(ctx, lamp, value);
+    return ret < 0 ? fail("led", ret) : 0;
+}
+
+static int cmd_group(struct smartlamp_ctx *ctx, int argc, char **argv) {
+    int lamps[SMARTLAMP_MAX_LAMPS], values[SMARTLAMP_MAX_LAMPS];
+    char *value;
+    int i, n, ret;
+
+    if (argc < 1 || argc > SMARTLAMP_MAX_LAMPS) usage();
+    for (i = 0; i < argc; i++) {
+        value = strchr(argv[i], '=');
+        if (!value) usage();
+        *value++ = '\0';
+        if (parse_int(argv[i], &lamps[i]) || parse_int(value, &values[i])) usage();
+    }
+    ret = smartlamp_set_led_group(ctx, lamps, values, argc);
+    if (ret == -EIO) {
+        // algumas lampadas podem ter mudado, mostra as que nao mudaram
+        n = smartlamp_group_failed(ctx, lamps, SMARTLAMP_MAX_LAMPS);
+        if (n > 0) {
+            fprintf(stderr, "group: lampadas sem o novo valor:");
+            for (i = 0; i < n; i++) fprintf(stderr, " %d", lamps[i]);
+            fprintf(stderr, "\n");
+        }
+    }
+    return ret < 0 ? fail("group", ret) : 0;
+}
+
+static int cmd_events(struct smartlamp_ctx *ctx, int argc, char **argv) {
+    int32_t delta, threshold = 0, hyst = 0, scale;
+    int lamp, sensor, ret;
+
+    if ((argc != 3 && argc != 5) || parse_int(argv[0], &lamp)) usage();
+    sensor = smartlamp_sensor_from_name(argv[1]);
+    if (sensor < 0) usage();
+    scale = smartlamp_sensor_scale(sensor);
+    if (parse_fixed(argv[2], scale, &delta)) usage();
+    if (argc == 5 && (parse_fixed(argv[3], scale, &threshold) || parse_fixed(argv[4], scale, &hyst))) usage();
+
+    ret = smartlamp_set_events(ctx, lamp, sensor, delta, argc == 5, threshold, hyst);
+    return ret < 0 ? fail("events", ret) : 0;
+}
+
+static int cmd_poll(struct smartlamp_ctx *ctx, int argc, char **argv) {
+    int lamp, period_ms, ret;
+
+    if (argc != 2 || parse_int(argv[0], &lamp) || parse_int(argv[1], &period_ms) || period_ms < 0) usage();
+    ret = smartlamp_set_poll(ctx, lamp, period_ms);
+    return ret < 0 ? fail("poll", ret) : 0;
+}
+
+static int cmd_batch(struct smartlamp_ctx *ctx, int argc, char **argv) {
+    int lamp, period_ms, records = 64, ret;
+
+    if (argc < 2 || argc > 3 || parse_int(argv[0], &lamp) || parse_int(argv[1], &period_ms) || period_ms < 0) usage();
+    if (argc == 3 && (parse_int(argv[2], &records) || records < 1)) usage();
+    ret = smartlamp_set_batch(ctx, lamp, period_ms, period_ms ? records : 0);
+    return ret < 0 ? fail("batch", ret) : 0;
+}
+
+// Um unico epoll para todas as lampadas: cada volta entrega as amostras de todas que avisaram
+static int cmd_watch(struct smartlamp_ctx *ctx, int argc, char **argv) {
+    struct smartlamp_sample samples[MAX_SAMPLES];
+    int timeout_ms = -1;
+    int i, n;
+
+    if (argc > 1 || (argc == 1 && parse_int(argv[0], &timeout_ms))) usage();
+    for (;;) {
+        n = smartlamp_wait(ctx, samples, MAX_SAMPLES, timeout_ms);
+        if (n < 0) return fail("watch", n);
+        if (n == 0 && timeout_ms >= 0) return 0;
+        for (i = 0; i < n; i++) print_sample(&samples[i]);
+        fflush(stdout);
+    }
+}
+
+static const char *state_name(int state) {
+    switch (state) {
+    case SMARTLAMP_LAMP_ONLINE: return "online";
+    case SMARTLAMP_LAMP_OFFLINE: return "offline";
+    case SMARTLAMP_LAMP_RECOVERING: return "recovering";
+    }
+    return "?";
+}
+
+// Pelo netlink: comeca com as ultimas amostras guardadas no driver e depois mostra cada
+// amostra e mudanca de estado, sem acessar o sysfs. Varios monitores nao aumentam o uso da USB.
+static int cmd_monitor(int argc) {
+    struct smartlamp_event events[MAX_SAMPLES];
+    struct smartlamp_nl *nl;
+    int i, n;
+
+    if (argc != 0) usage();
+    nl = smartlamp_nl_open();
+    if (!nl) return fail("netlink", -errno);
+
+    n = smartlamp_nl_request_samples(nl); // o seq nao interessa, as amostras chegam como eventos
+    if (n > 0) n = 0;
+    while (n >= 0) {
+        for (i = 0; i < n; i++) {
+            const struct smartlamp_event *event = &events[i];
+
+            if (event->type == SMARTLAMP_EVENT_SAMPLE) print_sample(&event->sample);
+            else if (event->type == SMARTLAMP_EVENT_LED) printf("lamp%d led %d\n", event->lamp, event->led);
+            else if (event->type == SMARTLAMP_EVENT_STATE) printf("lamp%d %s\n", event->lamp, state_name(event->state));
+        }
+        fflush(stdout);
+        n = smartlamp_nl_recv(nl, events, MAX_SAMPLES);
+        if (n == -ENOBUFS) {
+            fprintf(stderr, "smartlamp-cli: avisos perdidos\n");
+            n = 0;
+        }
+    }
+    smartlamp_nl_close(nl);
+    return fail("netlink", n);
+}
+
+int main(int argc, char **argv) {
+    struct smartlamp_ctx *ctx;
+    const char *root = NULL;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "r:h")) != -1) {
+        if (opt == 'r') root = optarg;
+        else usage();
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc < 1) usage();
+    if (!strcmp(argv[0], "monitor")) return cmd_monitor(argc - 1); // nao usa o sysfs
+
+    ctx = smartlamp_open(root);
+    if (!ctx) return fail(root ? root : SMARTLAMP_ROOT, -errno);
+
+    if (!strcmp(argv[0], "list")) ret = cmd_list(ctx);
+    else if (!strcmp(argv[0], "get")) ret = cmd_get(ctx, argc - 1, argv + 1);
+    else if (!strcmp(argv[0], "set")) ret = cmd_set(ctx, argc - 1, argv + 1);
+    else if (!strcmp(argv[0], "group")) ret = cmd_group(ctx, argc - 1, argv + 1);
+    else if (!strcmp(argv[0], "events")) ret = cmd_events(ctx, argc - 1, argv + 1);
+    else if (!strcmp(argv[0], "poll")) ret = cmd_poll(ctx, argc - 1, argv + 1);
+    else if (!strcmp(argv[0], "batch")) ret = cmd_batch(ctx, argc - 1, argv + 1);
+    else if (!strcmp(argv[0], "watch")) ret = cmd_watch(ctx, argc - 1, argv + 1);
+    else usage();
+
+    smartlamp_close(ctx);
+    return ret;
+}
@@ -0,0 +1,549 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "smartlamp.h"
+#include "smartlamp_proto.h" // leitura e escrita de valores em ponto fixo, o mesmo formato do driver
+
+#define READ_BUF_SIZE 512 // o arquivo samples tem uma linha curta por sensor
+
+// Arquivos abertos de uma lampada (/sys/kernel/smartlamp/lampN)
+struct smartlamp_lamp {
+    int id;                                 // N de lampN, -1 = posicao livre
+    int samples_fd;                         // registrado no epoll, acorda a cada aviso do firmware
+    int led_fd;
+    int events_fd;
+    int poll_fd;
+    int batch_fd;
+    int sensor_fd[SMARTLAMP_SENSOR_COUNT];
+    uint64_t last_ns[SMARTLAMP_SENSOR_COUNT]; // horario da ultima amostra entregue por sensor
+    bool pending;                           // tem amostras novas que nao couberam no ultimo dispatch
+    bool seen;                              // usado pelo smartlamp_rescan
+};
+
+struct smartlamp_ctx {
+    int root_fd;
+    int epoll_fd;
+    int group_fd;                           // aberto so na primeira escrita em grupo
+    struct smartlamp_lamp lamps[SMARTLAMP_MAX_LAMPS];
+};
+
+// --- Sensores ---
+
+const char *smartlamp_sensor_name(int sensor) {
+    if (sensor < 0 || sensor >= SMARTLAMP_SENSOR_COUNT) return NULL;
+    return sl_sensors[sensor].name;
+}
+
+int32_t smartlamp_sensor_scale(int sensor) {
+    if (sensor < 0 || sensor >= SMARTLAMP_SENSOR_COUNT) return 0;
+    return sl_sensors[sensor].scale;
+}
+
+static int sensor_lookup(const char *name, size_t len) {
+    int sensor;
+
+    for (sensor = 0; sensor < SMARTLAMP_SENSOR_COUNT; sensor++) {
+        if (strlen(sl_sensors[sensor].name) == len && !memcmp(sl_sensors[sensor].name, name, len)) return sensor;
+    }
+    return -1;
+}
+
+int smartlamp_sensor_from_name(const char *name) {
+    return sensor_lookup(name, strlen(name));
+}
+
+// --- Leitura e escrita dos arquivos ---
+
+static void close_fd(int *fd) {
+    if (*fd >= 0) close(*fd);
+    *fd = -1;
+}
+
+// Le o arquivo inteiro do inicio, sem fechar. O sysfs sempre gera o conteudo de novo
+// no offset 0, e a leitura tambem rearma o poll() do arquivo.
+static ssize_t read_file(int fd, char *buf, size_t size) {
+    ssize_t len;
+
+    if (fd < 0) return -EBADF;
+    len = pread(fd, buf, size, 0);
+    return len < 0 ? -errno : len;
+}
+
+static int write_file(int fd, const char *buf, size_t len) {
+    ssize_t ret;
+
+    if (fd < 0) return -EACCES; // arquivo sem permissao de escrita para este usuario
+    ret = pwrite(fd, buf, len, 0);
+    if (ret < 0) return errno == EBADF ? -EACCES : -errno; // aberto so para leitura
+    return (size_t)ret == len ? 0 : -EIO;
+}
+
+// Arquivos de leitura e escrita abertos so para leitura quando o usuario nao pode escrever
+static int open_rw(int dir_fd, const char *name) {
+    int fd = openat(dir_fd, name, O_RDWR | O_CLOEXEC);
+
+    if (fd < 0 && errno == EACCES) fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    return fd;
+}
+
+// Le "<valor>\n" em unidades de 1/scale
+static int parse_value(const char *buf, size_t len, int32_t scale, int32_t *value) {
+    const char *p = buf, *end = buf + len;
+
+    while (end > p && (end[-1] == '\n' || end[-1] == ' ')) end--;
+    if (sl_parse_fixed(&p, end, scale, value) || p != end) return -EPROTO;
+    return 0;
+}
+
+// Decodifica o arquivo samples, linhas "<sensor> <valor> <host_ns>", em samples[sensor].
+// Retorna a mascara dos sensores encontrados; linhas de sensores desconhecidos sao ignoradas.
+static int parse_samples(const char *buf, size_t len, int lamp, struct smartlamp_sample *samples) {
+    const char *line = buf, *end = buf + len, *eol, *p, *token;
+    struct smartlamp_sample *sample;
+    size_t token_len;
+    int sensor, mask = 0;
+
+    for (; line < end; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        p = line;
+
+        token_len = sl_token(&p, eol, &token);
+        sensor = sensor_lookup(token, token_len);
+        if (sensor < 0) continue;
+
+        sample = &samples[sensor];
+        sample->lamp = lamp;
+        sample->sensor = sensor;
+        sample->scale = sl_sensors[sensor].scale;
+        sl_skip_spaces(&p, eol);
+        if (sl_parse_fixed(&p, eol, sample->scale, &sample->raw)) return -EPROTO;
+        sl_skip_spaces(&p, eol);
+        if (sl_parse_u64(&p, eol, &sample->host_ns)) return -EPROTO;
+        mask |= 1 << sensor;
+    }
+    return mask;
+}
+
+// Le o arquivo samples de uma lampada. Retorna a mascara dos sensores com amostra, ou -errno.
+static int read_samples(struct smartlamp_lamp *lamp, struct smartlamp_sample *samples) {
+    char buf[READ_BUF_SIZE];
+    ssize_t len = read_file(lamp->samples_fd, buf, sizeof(buf));
+
+    if (len < 0) return len;
+    return parse_samples(buf, len, lamp->id, samples);
+}
+
+// --- Lampadas ---
+
+static struct smartlamp_lamp *find_lamp(struct smartlamp_ctx *ctx, int id) {
+    int i;
+
+    for (i = 0; i < SMARTLAMP_MAX_LAMPS; i++) {
+        if (ctx->lamps[i].id == id && id >= 0) return &ctx->lamps[i];
+    }
+    return NULL;
+}
+
+static void lamp_close(struct smartlamp_ctx *ctx, struct smartlamp_lamp *lamp) {
+    int sensor;
+
+    if (lamp->samples_fd >= 0) epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, lamp->samples_fd, NULL);
+    close_fd(&lamp->samples_fd);
+    close_fd(&lamp->led_fd);
+    close_fd(&lamp->events_fd);
+    close_fd(&lamp->poll_fd);
+    close_fd(&lamp->batch_fd);
+    for (sensor = 0; sensor < SMARTLAMP_SENSOR_COUNT; sensor++) close_fd(&lamp->sensor_fd[sensor]);
+    lamp->id = -1;
+}
+
+static void lamp_init(struct smartlamp_lamp *lamp) {
+    int sensor;
+
+    memset(lamp, 0, sizeof(*lamp));
+    lamp->id = -1;
+    lamp->samples_fd = lamp->led_fd = lamp->events_fd = lamp->poll_fd = lamp->batch_fd = -1;
+    for (sensor = 0; sensor < SMARTLAMP_SENSOR_COUNT; sensor++) lamp->sensor_fd[sensor] = -1;
+}
+
+// Abre os arquivos de lampN e registra o samples no epoll
+static int lamp_open(struct smartlamp_ctx *ctx, struct smartlamp_lamp *lamp, int id, const char *dir_name) {
+    struct smartlamp_sample samples[SMARTLAMP_SENSOR_COUNT];
+    struct epoll_event ev = { .events = EPOLLPRI };
+    int sensor, mask, dir_fd, ret;
+
+    lamp_init(lamp);
+    lamp->id = id;
+    dir_fd = openat(ctx->root_fd, dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return -errno;
+    lamp->samples_fd = openat(dir_fd, "samples", O_RDONLY | O_CLOEXEC);
+    lamp->led_fd = open_rw(dir_fd, "led");
+    lamp->events_fd = open_rw(dir_fd, "events");
+    lamp->poll_fd = open_rw(dir_fd, "poll");
+    lamp->batch_fd = open_rw(dir_fd, "batch");
+    for (sensor = 0; sensor < SMARTLAMP_SENSOR_COUNT; sensor++) {
+        lamp->sensor_fd[sensor] = openat(dir_fd, sl_sensors[sensor].name, O_RDONLY | O_CLOEXEC);
+    }
+    close(dir_fd);
+
+    // a primeira leitura arma o poll, e as amostras que ja existem nao sao entregues como novas
+    mask = read_samples(lamp, samples);
+    if (mask < 0) {
+        ret = mask;
+        goto err;
+    }
+    for (sensor = 0; sensor < SMARTLAMP_SENSOR_COUNT; sensor++) {
+        if (mask & (1 << sensor)) lamp->last_ns[sensor] = samples[sensor].host_ns;
+    }
+
+    ev.data.u32 = lamp - ctx->lamps;
+    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, lamp->samples_fd, &ev) < 0) {
+        ret = -errno;
+        goto err;
+    }
+    return 0;
+
+err:
+    lamp_close(ctx, lamp);
+    return ret;
+}
+
+int smartlamp_rescan(struct smartlamp_ctx *ctx) {
+    struct smartlamp_lamp *lamp;
+    struct dirent *entry;
+    char *end;
+    long id;
+    int i, fd, count = 0;
+    DIR *dir;
+
+    fd = openat(ctx->root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -errno;
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -errno;
+    }
+
+    for (i = 0; i < SMARTLAMP_MAX_LAMPS; i++) ctx->lamps[i].seen = false;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "lamp", 4) != 0) continue;
+        id = strtol(entry->d_name + 4, &end, 10);
+        if (end == entry->d_name + 4 || *end || id < 0) continue;
+
+        lamp = find_lamp(ctx, id);
+        if (!lamp) {
+            for (i = 0; i < SMARTLAMP_MAX_LAMPS && !lamp; i++) {
+                if (ctx->lamps[i].id < 0) lamp = &ctx->lamps[i];
+            }
+            if (!lamp) break; // mais lampadas que SMARTLAMP_MAX_LAMPS
+            if (lamp_open(ctx, lamp, id, entry->d_name) < 0) continue; // removida enquanto abria
+        }
+        lamp->seen = true;
+    }
+    closedir(dir);
+
+    for (i = 0; i < SMARTLAMP_MAX_LAMPS; i++) {
+        lamp = &ctx->lamps[i];
+        if (lamp->id < 0) continue;
+        if (lamp->seen) count++;
+        else lamp_close(ctx, lamp);
+    }
+    return count;
+}
+
+struct smartlamp_ctx *smartlamp_open(const char *root) {
+    struct smartlamp_ctx *ctx;
+    int i, ret;
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) return NULL;
+    ctx->group_fd = -1;
+    for (i = 0; i < SMARTLAMP_MAX_LAMPS; i++) lamp_init(&ctx->lamps[i]);
+
+    ctx->root_fd = open(root ? root : SMARTLAMP_ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->root_fd < 0 || ctx->epoll_fd < 0) goto err;
+
+    ret = smartlamp_rescan(ctx);
+    if (ret < 0) {
+        errno = -ret;
+        goto err;
+    }
+    return ctx;
+
+err:
+    ret = errno;
+    smartlamp_close(ctx);
+    errno = ret;
+    return NULL;
+}
+
+void smartlamp_close(struct smartlamp_ctx *ctx) {
+    int i;
+
+    if (!ctx) return;
+    for (i = 0; i < SMARTLAMP_MAX_LAMPS; i++) {
+        if (ctx->lamps[i].id >= 0) lamp_close(ctx, &ctx->lamps[i]);
+    }
+    if (ctx->group_fd >= 0) close(ctx->group_fd);
+    if (ctx->epoll_fd >= 0) close(ctx->epoll_fd);
+    if (ctx->root_fd >= 0) close(ctx->root_fd);
+    free(ctx);
+}
+
+int smartlamp_lamps(const struct smartlamp_ctx *ctx, int *ids, int max) {
+    int i, j, n = 0, id;
+
+    // em ordem crescente de id
+    for (i = 0; i < SMARTLAMP_MAX_LAMPS; i++) {
+        id = ctx->lamps[i].id;
+        if (id < 0) continue;
+        if (n < max) {
+            for (j = n; j > 0 && ids[j - 1] > id; j--) ids[j] = ids[j - 1];
+            ids[j] = id;
+        }
+        n++;
+    }
+    return n;
+}
+
+// --- Amostras ---
+
+int smartlamp_fd(const struct smartlamp_ctx *ctx) {
+    return ctx->epoll_fd;
+}
+
+// Entrega em out as amostras da lampada mais novas que a ultima entregue.
+// Se out encher antes, a lampada fica pendente e o resto sai no proximo dispatch.
+static int emit_new_samples(struct smartlamp_lamp *lamp, struct smartlamp_sample *out, int max) {
+    struct smartlamp_sample samples[SMARTLAMP_SENSOR_COUNT];
+    int sensor, n = 0, mask;
+
+    lamp->pending = false;
+    mask = read_samples(lamp, samples);
+    if (mask < 0) return mask;
+    for (sensor = 0; sensor < SMARTLAMP_SENSOR_COUNT; sensor++) {
+        if (!(mask & (1 << sensor)) || samples[sensor].host_ns == lamp->last_ns[sensor]) continue;
+        if (n == max) {
+            lamp->pending = true;
+            break;
+        }
+        lamp->last_ns[sensor] = samples[sensor].host_ns;
+        out[n++] = samples[sensor];
+    }
+    return n;
+}
+
+static int emit_lamp(struct smartlamp_ctx *ctx, struct smartlamp_lamp *lamp, struct smartlamp_sample *out, int max) {
+    int ret = emit_new_samples(lamp, out, max);
+
+    if (ret == -ENODEV || ret == -ENOENT) {
+        lamp_close(ctx, lamp); // lampada desconectada
+        return 0;
+    }
+    return ret < 0 ? 0 : ret;
+}
+
+static int dispatch(struct smartlamp_ctx *ctx, struct smartlamp_sample *out, int max, int timeout_ms) {
+    struct epoll_event events[SMARTLAMP_MAX_LAMPS];
+    int i, n, count = 0;
+
+    if (max <= 0) return -EINVAL;
+
+    // primeiro o que nao coube no dispatch anterior: o epoll nao avisa essas lampadas de novo
+    for (i = 0; i < SMARTLAMP_MAX_LAMPS && count < max; i++) {
+        if (ctx->lamps[i].id >= 0 && ctx->lamps[i].pending) {
+            count += emit_lamp(ctx, &ctx->lamps[i], out + count, max - count);
+        }
+    }
+    if (count == max) return count;
+
+    // as lampadas que nao forem lidas agora continuam prontas no epoll
+    n = max - count;
+    if (n > SMARTLAMP_MAX_LAMPS) n = SMARTLAMP_MAX_LAMPS;
+    n = epoll_wait(ctx->epoll_fd, events, n, count ? 0 : timeout_ms);
+    if (n < 0) return errno == EINTR ? count : -errno;
+
+    for (i = 0; i < n && count < max; i++) {
+        count += emit_lamp(ctx, &ctx->lamps[events[i].data.u32], out + count, max - count);
+    }
+    return count;
+}
+
+int smartlamp_dispatch(struct smartlamp_ctx *ctx, struct smartlamp_sample *out, int max) {
+    return dispatch(ctx, out, max, 0);
+}
+
+int smartlamp_wait(struct smartlamp_ctx *ctx, struct smartlamp_sample *out, int max, int timeout_ms) {
+    return dispatch(ctx, out, max, timeout_ms);
+}
+
+int smartlamp_read_all(struct smartlamp_ctx *ctx, struct smartlamp_sample *out, int max) {
+    struct smartlamp_sample samples[SMARTLAMP_SENSOR_COUNT];
+    int i, sensor, mask, n = 0;
+
+    for (i = 0; i < SMARTLAMP_MAX_LAMPS; i++) {
+        if (ctx->lamps[i].id < 0) continue;
+        mask = read_samples(&ctx->lamps[i], samples);
+        if (mask < 0) continue; // lampada desconectada, sai no proximo rescan
+        for (sensor = 0; sensor < SMARTLAMP_SENSOR_COUNT && n < max; sensor++) {
+            if (mask & (1 << sensor)) out[n++] = samples[sensor];
+        }
+    }
+    return n;
+}
+
+int smartlamp_read_sensor(struct smartlamp_ctx *ctx, int id, int sensor, struct smartlamp_sample *out) {
+    struct smartlamp_lamp *lamp = find_lamp(ctx, id);
+    char buf[READ_BUF_SIZE];
+    ssize_t len;
+
+    if (!lamp) return -ENODEV;
+    if (sensor < 0 || sensor >= SMARTLAMP_SENSOR_COUNT) return -EINVAL;
+
+    len = read_file(lamp->sensor_fd[sensor], buf, sizeof(buf));
+    if (len < 0) return len;
+    // o driver escreve "-1" quando a leitura falha
+    if (len >= 2 && !memcmp(buf, "-1", 2) && (len == 2 || buf[2] == '\n')) return -EIO;
+
+    out->lamp = id;
+    out->sensor = sensor;
+    out->scale = sl_sensors[sensor].scale;
+    // o arquivo do sensor nao tem o horario da leitura, e o samples pode ja ter outra
+    // amostra com o mesmo valor (alem de consumir o aviso do epoll)
+    out->host_ns = 0;
+    return parse_value(buf, len, out->scale, &out->raw);
+}
+
+// --- LED e avisos ---
+
+int smartlamp_get_led(struct smartlamp_ctx *ctx, int id) {
+    struct smartlamp_lamp *lamp = find_lamp(ctx, id);
+    char buf[READ_BUF_SIZE];
+    int32_t value;
+    ssize_t len;
+    int ret;
+
+    if (!lamp) return -ENODEV;
+    len = read_file(lamp->led_fd, buf, sizeof(buf));
+    if (len < 0) return len;
+    ret = parse_value(buf, len, 1, &value);
+    if (ret) return ret;
+    return value < 0 ? -EIO : value;
+}
+
+int smartlamp_set_led(struct smartlamp_ctx *ctx, int id, int value) {
+    struct smartlamp_lamp *lamp = find_lamp(ctx, id);
+    char buf[16];
+    size_t n;
+
+    if (!lamp) return -ENODEV;
+    if (value < 0 || value > 100) return -EINVAL;
+    n = sl_put_u32(buf, value);
+    buf[n++] = '\n';
+    return write_file(lamp->led_fd, buf, n);
+}
+
+int smartlamp_set_led_group(struct smartlamp_ctx *ctx, const int *ids, const int *values, int count) {
+    char buf[SMARTLAMP_MAX_LAMPS * 16];
+    size_t n = 0;
+    int i;
+
+    if (count <= 0 || count > SMARTLAMP_MAX_LAMPS) return -EINVAL;
+    for (i = 0; i < count; i++) {
+        if (ids[i] < 0 || values[i] < 0 || values[i] > 100) return -EINVAL;
+        n += sl_put_u32(buf + n, ids[i]);
+        buf[n++] = '=';
+        n += sl_put_u32(buf + n, values[i]);
+        buf[n++] = ' ';
+    }
+    buf[n - 1] = '\n';
+
+    if (ctx->group_fd < 0) {
+        ctx->group_fd = openat(ctx->root_fd, "group", O_WRONLY | O_CLOEXEC);
+        if (ctx->group_fd < 0) return -errno;
+    }
+    return write_file(ctx->group_fd, buf, n);
+}
+
+int smartlamp_group_failed(struct smartlamp_ctx *ctx, int *ids, int max) {
+    char buf[SMARTLAMP_MAX_LAMPS * 12];
+    const char *p = buf, *end;
+    uint64_t id;
+    ssize_t len;
+    int fd, n = 0;
+
+    fd = openat(ctx->root_fd, "group", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -errno;
+    len = read_file(fd, buf, sizeof(buf));
+    close(fd);
+    if (len < 0) return len;
+
+    // "<id> <id> ...\n", linha vazia se todas mudaram
+    end = buf + len;
+    while (end > p && end[-1] == '\n') end--;
+    while (n < max) {
+        sl_skip_spaces(&p, end);
+        if (p == end) break;
+        if (sl_parse_u64(&p, end, &id)) return -EPROTO;
+        ids[n++] = (int)id;
+    }
+    return n;
+}
+
+int smartlamp_set_events(struct smartlamp_ctx *ctx, int id, int sensor, int32_t delta,
+                         int threshold_enabled, int32_t threshold, int32_t hyst) {
+    struct smartlamp_lamp *lamp = find_lamp(ctx, id);
+    char buf[SL_MAX_LINE];
+    int32_t scale;
+    size_t n;
+
+    if (!lamp) return -ENODEV;
+    if (sensor < 0 || sensor >= SMARTLAMP_SENSOR_COUNT || delta < 0 || hyst < 0) return -EINVAL;
+    scale = sl_sensors[sensor].scale;
+
+    n = sl_put_str(buf, sl_sensors[sensor].name, strlen(sl_sensors[sensor].name));
+    buf[n++] = ' ';
+    n += sl_put_fixed(buf + n, delta, scale);
+    if (threshold_enabled) {
+        buf[n++] = ' ';
+        n += sl_put_fixed(buf + n, threshold, scale);
+        buf[n++] = ' ';
+        n += sl_put_fixed(buf + n, hyst, scale);
+    }
+    buf[n++] = '\n';
+    return write_file(lamp->events_fd, buf, n);
+}
+
+int smartlamp_set_poll(struct smartlamp_ctx *ctx, int id, unsigned int period_ms) {
+    struct smartlamp_lamp *lamp = find_lamp(ctx, id);
+    char buf[16];
+    size_t n;
+
+    if (!lamp) return -ENODEV;
+    n = sl_put_u32(buf, period_ms);
+    buf[n++] = '\n';
+    return write_file(lamp->poll_fd, buf, n);
+}
+
+int smartlamp_set_batch(struct smartlamp_ctx *ctx, int id, unsigned int period_ms, unsigned int records) {
+    struct smartlamp_lamp *lamp = find_lamp(ctx, id);
+    char buf[32];
+    size_t n;
+
+    if (!lamp) return -ENODEV;
+    n = sl_put_u32(buf, period_ms);
+    buf[n++] = ' ';
+    n += sl_put_u32(buf + n, records);
+    buf[n++] = '\n';
+    return write_file(lamp->batch_fd, buf, n);
+}
@@ -0,0 +1,171 @@
+#ifndef LIBSMARTLAMP_H
+#define LIBSMARTLAMP_H
+
+// libsmartlamp: acesso as lampadas pelo sysfs do driver (/sys/kernel/smartlamp)
+//
+// Os arquivos de cada lampada sao abertos uma vez so e lidos com pread, sem
+// open/read/close a cada leitura. As leituras sao decodificadas direto para
+// struct smartlamp_sample, sem alocar memoria.
+//
+// Para coletar amostras de muitas lampadas, em vez de ler os sensores em um laco:
+//   1. smartlamp_set_events() pede ao firmware para avisar quando um sensor mudar
+//   2. smartlamp_fd() entra no epoll/poll/select do programa (ou use smartlamp_wait())
+//   3. quando ele acordar, smartlamp_dispatch() le o arquivo samples de todas as lampadas
+//      que avisaram e entrega as amostras novas de uma vez
+// O arquivo samples guarda a ultima amostra de cada sensor e eh lido sem acessar a USB.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "smartlamp_sensors.h" // tabela SL_SENSORS, a mesma do firmware e do driver
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SMARTLAMP_ROOT "/sys/kernel/smartlamp"
+#define SMARTLAMP_MAX_LAMPS 64 // o mesmo limite da escrita no arquivo group
+
+// Sensores, gerados da tabela SL_SENSORS (SMARTLAMP_LDR, SMARTLAMP_TEMP, SMARTLAMP_HUM, ...)
+enum smartlamp_sensor {
+#define SL_X(id, name, scale, period_ms, read) SMARTLAMP_##id,
+    SL_SENSORS(SL_X)
+#undef SL_X
+    SMARTLAMP_SENSOR_COUNT
+};
+
+struct smartlamp_sample {
+    int lamp;          // numero da lampada (o N de lampN)
+    int sensor;        // enum smartlamp_sensor
+    int32_t raw;       // valor em unidades de 1/scale, como no driver (2350 = 23.50)
+    int32_t scale;     // 1 para ldr, 100 para temp e hum
+    uint64_t host_ns;  // horario da leitura no CLOCK_MONOTONIC, 0 se desconhecido
+};
+
+struct smartlamp_ctx;
+
+// Abre todas as lampadas em root (NULL = SMARTLAMP_ROOT).
+// Retorna NULL com errno em caso de erro.
+struct smartlamp_ctx *smartlamp_open(const char *root);
+void smartlamp_close(struct smartlamp_ctx *ctx);
+
+// Procura de novo as lampadas (lampada conectada ou removida).
+// As lampadas que continuam conectadas mantem os arquivos abertos. Retorna o numero de lampadas.
+int smartlamp_rescan(struct smartlamp_ctx *ctx);
+
+// Lampadas abertas, ids[] recebe os numeros das lampadas (ate max). Retorna quantas sao.
+int smartlamp_lamps(const struct smartlamp_ctx *ctx, int *ids, int max);
+
+// Descritor epoll que fica pronto quando alguma lampada avisa uma amostra nova.
+// Pode ser colocado no laco de eventos do programa; depois chame smartlamp_dispatch().
+int smartlamp_fd(const struct smartlamp_ctx *ctx);
+
+// Le as amostras novas das lampadas que avisaram, sem bloquear.
+// Retorna quantas amostras foram escritas em out (ate max, max >= 1), ou -errno.
+// As que nao couberem em out ficam guardadas e saem na proxima chamada.
+int smartlamp_dispatch(struct smartlamp_ctx *ctx, struct smartlamp_sample *out, int max);
+
+// Espera ate timeout_ms (-1 = sem limite) por amostras novas e as le. Retorna como smartlamp_dispatch.
+int smartlamp_wait(struct smartlamp_ctx *ctx, struct smartlamp_sample *out, int max, int timeout_ms);
+
+// Ultima amostra de cada sensor de todas as lampadas, sem acessar a USB.
+// Retorna quantas amostras foram escritas em out (ate max), ou -errno.
+int smartlamp_read_all(struct smartlamp_ctx *ctx, struct smartlamp_sample *out, int max);
+
+// Leitura de um sensor pela USB (bloqueia ate o firmware responder). Retorna 0 ou -errno.
+// out->host_ns fica 0: o arquivo do sensor nao tem o horario. Para a leitura com horario
+// use smartlamp_nl_request_sensor(), a resposta SAMPLE traz o TIME_NS do driver.
+int smartlamp_read_sensor(struct smartlamp_ctx *ctx, int lamp, int sensor, struct smartlamp_sample *out);
+
+// Brilho do LED, 0 a 100. Retornam o valor / 0, ou -errno.
+int smartlamp_get_led(struct smartlamp_ctx *ctx, int lamp);
+int smartlamp_set_led(struct smartlamp_ctx *ctx, int lamp, int value);
+
+// Altera o brilho de varias lampadas juntas (arquivo group). Retorna 0 ou -errno.
+// Com -EIO algumas lampadas podem ter mudado e outras nao: smartlamp_group_failed() diz quais nao mudaram.
+int smartlamp_set_led_group(struct smartlamp_ctx *ctx, const int *lamps, const int *values, int n);
+
+// Lampadas que nao confirmaram o novo valor na ultima atualizacao em grupo (de qualquer
+// programa), ids[] recebe ate max. Retorna quantas sao, ou -errno.
+int smartlamp_group_failed(struct smartlamp_ctx *ctx, int *ids, int max);
+
+// Configura os avisos de um sensor, valores em unidades de 1/scale.
+// delta = 0 desliga o aviso por mudanca; threshold_enabled liga o aviso por limite com histerese.
+int smartlamp_set_events(struct smartlamp_ctx *ctx, int lamp, int sensor, int32_t delta,
+                         int threshold_enabled, int32_t threshold, int32_t hyst);
+
+// Leituras periodicas feitas pelo driver em segundo plano, a cada period_ms (0 desliga).
+// Cada leitura chega como uma amostra nova no smartlamp_dispatch(). Retorna 0 ou -errno.
+int smartlamp_set_poll(struct smartlamp_ctx *ctx, int lamp, unsigned int period_ms);
+
+// Lotes do firmware: todos os sensores lidos a cada period_ms (10 a 60000, 0 desliga) e
+// enviados de records em records (1 a 64) em uma linha compactada. Cada amostra do lote
+// chega pelo canal netlink; o smartlamp_dispatch() so ve a mais recente de cada sensor.
+int smartlamp_set_batch(struct smartlamp_ctx *ctx, int lamp, unsigned int period_ms, unsigned int records);
+
+// Nome do sensor no sysfs ("ldr", "temp", "hum") e escala, NULL/0 se invalido
+const char *smartlamp_sensor_name(int sensor);
+int32_t smartlamp_sensor_scale(int sensor);
+int smartlamp_sensor_from_name(const char *name);
+
+// --- Canal netlink ---
+// O driver tambem envia cada amostra lida (por qualquer programa, aviso do firmware ou
+// leitura periodica) e cada mudanca de estado para todos os programas inscritos na
+// familia generic netlink "smartlamp". Cada programa recebe tudo sem abrir o sysfs e sem
+// leituras extras na USB. Os pedidos (smartlamp_nl_request_*, smartlamp_nl_set_led) nao
+// esperam a resposta: ela chega pelo smartlamp_nl_recv() junto com os avisos, e cada
+// pedido termina com um SMARTLAMP_EVENT_ACK com o mesmo seq.
+
+enum smartlamp_event_type {
+    SMARTLAMP_EVENT_SAMPLE, // amostra nova em sample
+    SMARTLAMP_EVENT_LED,    // LED alterado (ou resposta do smartlamp_nl_request_led), valor em led
+    SMARTLAMP_EVENT_STATE,  // lampada conectada, desconectada ou em recuperacao, em state
+    SMARTLAMP_EVENT_ACK,    // fim de um pedido, error = 0 ou -errno
+};
+
+enum smartlamp_state {
+    SMARTLAMP_LAMP_ONLINE,
+    SMARTLAMP_LAMP_OFFLINE,
+    SMARTLAMP_LAMP_RECOVERING,
+};
+
+struct smartlamp_event {
+    int type;                       // enum smartlamp_event_type
+    int lamp;
+    uint32_t seq;                   // seq do pedido nas respostas, 0 nos avisos
+    struct smartlamp_sample sample; // SMARTLAMP_EVENT_SAMPLE
+    int led;                        // SMARTLAMP_EVENT_LED
+    int state;                      // SMARTLAMP_EVENT_STATE, enum smartlamp_state
+    int error;                      // SMARTLAMP_EVENT_ACK
+};
+
+struct smartlamp_nl;
+
+// Abre o canal e se inscreve nos avisos. Retorna NULL com errno em caso de erro
+// (ENOENT se o driver nao estiver carregado).
+struct smartlamp_nl *smartlamp_nl_open(void);
+void smartlamp_nl_close(struct smartlamp_nl *nl);
+
+// Descritor do socket, fica pronto para leitura quando chega um aviso ou resposta
+int smartlamp_nl_fd(const struct smartlamp_nl *nl);
+
+// Espera chegar alguma mensagem e decodifica todas as que chegaram juntas.
+// Retorna quantos eventos foram escritos em out (ate max, o resto eh descartado), ou -errno.
+// Se os avisos chegarem mais rapido do que sao lidos o kernel descarta alguns e retorna -ENOBUFS.
+int smartlamp_nl_recv(struct smartlamp_nl *nl, struct smartlamp_event *out, int max);
+
+// Pedidos, retornam o seq (> 0) ou -errno
+int smartlamp_nl_request_samples(struct smartlamp_nl *nl);                 // ultimas amostras, sem USB
+int smartlamp_nl_request_sensor(struct smartlamp_nl *nl, int lamp, int sensor); // leitura pela USB
+int smartlamp_nl_request_led(struct smartlamp_nl *nl, int lamp);
+int smartlamp_nl_set_led(struct smartlamp_nl *nl, int lamp, int value);    // precisa de CAP_NET_ADMIN
+
+// Valor da amostra em ponto flutuante (raw / scale)
+static inline double smartlamp_sample_value(const struct smartlamp_sample *sample) {
+    return (double)sample->raw / sample->scale;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBSMARTLAMP_H
@@ -4,6 +4,8 @@
 #include <linux/kernel.h>
 #include <linux/delay.h>
 
+#include "smartlamp_proto.h" // comandos e formato das linhas, o mesmo arquivo usado pelo firmware
+
 MODULE_AUTHOR("DevTITANS <devtitans@icomp.ufam.edu.br>");
 MODULE_DESCRIPTION("Driver de acesso ao SmartLamp (ESP32 com Chip Serial CP2102)");
 MODULE_LICENSE("GPL");
@@ -62,8 +64,10 @@ static int activate_cp210x_uart(void) {
 // Executado quando o dispositivo é conectado na USB
 static int usb_probe(struct usb_interface *interface, const struct usb_device_id *id) {
     struct usb_endpoint_descriptor *usb_endpoint_in, *usb_endpoint_out;
+    char command[MAX_RECV_LINE];
     printk(KERN_INFO "SmartLamp: Dispositivo conectado ...\n");
 
+    sl_proto_init();
     smartlamp_device = interface_to_usbdev(interface);
 
     // 1. ATIVA A UART DO CHIP
@@ -83,7 +87,8 @@ static int usb_probe(struct usb_interface *interface, const struct usb_device_id
 
     // 3. Inicia a comunicação enviando o comando
     msleep(200); // Espera o dispositivo se estabilizar
-    if (usb_write_serial("GET_LDR\n") == 0) {
+    sl_encode_cmd(command, SL_CMD_GET_LDR);
+    if (usb_write_serial(command) == 0) {
         printk(KERN_INFO "SmartLamp: Comando 'GET_LDR' enviado.\n");
         msleep(100); // Espera o dispositivo processar e responder
         LDR_value = usb_read_serial();
@@ -109,6 +114,20 @@ static void usb_disconnect(struct usb_interface *interface) {
     kfree(usb_out_buffer);
 }
 
+// Decodifica a primeira linha recebida com o smartlamp_proto.h, o mesmo formato do
+// firmware e do smartlamp.c. Retorna 0 e o valor (em unidades de 1/escala) se a linha
+// for a resposta "RES <cmd> <valor>".
+static int parse_response(const char *buf, int len, int cmd, int *value) {
+    const char *eol = memchr(buf, '\n', len);
+    struct sl_msg msg;
+
+    if (eol) len = eol - buf;
+    if (sl_parse_line(buf, len, &msg) < 0) return -1;
+    if (msg.kind != SL_MSG_RES || msg.cmd != cmd || !msg.has_value) return -1;
+    *value = msg.value;
+    return 0;
+}
+
 // Função para enviar um comando para o dispositivo
 static int usb_write_serial(const char* command) {
     int ret, actual_size;
@@ -133,8 +152,7 @@ static int usb_read_serial(void) {
             printk(KERN_ERR "SmartLamp: Erro ao ler dados (tentativa %d). Codigo: %d\n", retries, ret);
             continue;
         }
-        usb_in_buffer[actual_size] = '\0';
-        if (sscanf(usb_in_buffer, "RES GET_LDR %d", &val) == 1) {
+        if (parse_response(usb_in_buffer, actual_size, SL_CMD_GET_LDR, &val) == 0) {
             return val;
         }
     }
@@ -5,23 +5,177 @@
 #include <linux/delay.h> // msleep
 #include <linux/kobject.h> // Adicionado para sysfs
 #include <linux/sysfs.h>   // Adicionado para sysfs
+#include <linux/mutex.h>   // serializa o acesso a cada lampada
+#include <linux/kref.h>    // contagem de referencias das lampadas
+#include <linux/idr.h>     // numeracao das lampadas (lamp0, lamp1, ...)
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>   // relogio monotonic do host
+#include <linux/math64.h>  // divisoes de 64 bits
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/completion.h> // envios assincronos da atualizacao em grupo
+#include <net/genetlink.h> // canal netlink para os programas que acompanham as lampadas
+
+#include "smartlamp_proto.h" // comandos e formato das linhas, o mesmo arquivo usado pelo firmware
+#include "smartlamp_genl.h"  // familia generic netlink, o mesmo arquivo usado pela libsmartlamp
 
 MODULE_AUTHOR("DevTITANS <devtitans@icomp.ufam.edu.br>");
 MODULE_DESCRIPTION("Driver de acesso ao SmartLamp (ESP32 com Chip Serial CP2102)");
 MODULE_LICENSE("GPL");
 
-#define MAX_RECV_LINE 100
+#define MAX_RECV_LINE SL_MAX_LINE
+#define MAX_GROUP_LAMPS 64 // maximo de lampadas em uma unica escrita no arquivo group
+#define RESPONSE_TIMEOUT_MS 1500 // tempo maximo esperando a resposta de um comando
+#define EVENT_QUEUE_LEN 8  // linhas "EVT ..." guardadas ate a event_work processar
+#define BATCH_QUEUE_LEN 4  // linhas "BAT ..." guardadas ate a event_work processar
+#define USB_TIMEOUT_MS 250 // envio de um comando (< 100 bytes) leva poucos ms, mais que isso eh falha
+#define GENL_WAIT_MS 1000  // prazo de um comando do netlink na fila da lampada
+// depois de um aviso ao poll(), a leitura do arquivo do sensor devolve a amostra avisada
+// sem ir a USB durante este tempo, para todos os programas que acordaram com o aviso
+#define NOTIFY_FRESH_NS (1 * NSEC_PER_SEC)
+
+// --- Recuperacao de falhas ---
+// Quando a lampada para de responder a recuperacao roda em uma work: limpa o halt dos
+// endpoints e confere se o firmware responde; se nao responder, reseta o dispositivo USB.
+// Enquanto isso os comandos falham na hora com -ETIMEDOUT em vez de esperar o timeout.
+#define RECOVERY_PROBE_TIMEOUT_MS 300 // espera pela resposta do GET_TIME de teste
+#define RECOVERY_RETRY_MIN_MS 500     // se a recuperacao falhar tenta de novo depois disso,
+#define RECOVERY_RETRY_MAX_MS 8000    // dobrando o intervalo ate este limite
+#define UART_BAUD_RATE 115200         // o mesmo do Serial.begin() do firmware
+
+// --- Escalonamento dos comandos ---
+// Cada lampada atende um comando por vez. Quem espera a vez fica na fila da sua classe,
+// e a proxima vez vai sempre para a classe mais urgente, na ordem de chegada dentro dela.
+// Um pedido com prazo (deadline) que ja passou eh descartado quando chegaria a sua vez.
+enum smartlamp_prio {
+    SMARTLAMP_PRIO_INTERACTIVE, // comandos do usuario que mudam a lampada (led, group, events)
+    SMARTLAMP_PRIO_ONDEMAND,    // leituras pedidas pelo usuario (cat led, ldr, temp, hum)
+    SMARTLAMP_PRIO_BACKGROUND,  // leituras periodicas do arquivo poll
+    SMARTLAMP_PRIO_COUNT,
+};
+
+#define POLL_MIN_MS 100 // menor intervalo aceito no arquivo poll
+
+// --- Sincronizacao de relogio ---
+#define CLOCK_SYNC_INTERVAL_NS (10 * NSEC_PER_SEC) // intervalo entre sincronizacoes com o GET_TIME
+#define CLOCK_MAX_DRIFT_PPB 500000                 // 500 ppm, bem acima do erro de um cristal comum
+#define UART_NS_PER_BYTE 86806                     // 10 bits por byte a 115200 baud
+
+// Quando o firmware deve avisar sobre um sensor sem ser perguntado (linha "EVT ...")
+// delta: avisa quando o valor muda pelo menos isso desde o ultimo aviso (0 = desligado)
+// threshold/hyst: avisa quando o valor passa de threshold + hyst ou cai abaixo de threshold - hyst
+struct smartlamp_event_config {
+    int delta;              // em unidades de 1/scale, como as amostras
+    bool threshold_enabled;
+    int threshold;
+    int hyst;
+};
+
+// Ultima amostra de um sensor, com o horario ja convertido para o relogio do host
+struct smartlamp_sample {
+    bool valid;
+    int value;      // em unidades de 1/scale
+    u64 host_ns;    // ktime_get_ns() do instante em que o firmware leu o sensor
+};
+
+// Estimativa da relacao entre o relogio do firmware e o relogio do host:
+// host_ns = dev_ns + offset_ns + drift_ppb * (dev_ns - ref_dev_ns) / 1e9
+struct smartlamp_clock {
+    bool valid;
+    s64 offset_ns;
+    s64 ref_dev_ns;
+    s64 drift_ppb;
+    u64 last_sync_ns;  // quando foi feita a ultima sincronizacao (relogio do host)
+};
+
+// --- Estado de cada lampada conectada ---
+// antes o driver guardava tudo em variaveis globais e so suportava uma lampada,
+// agora cada dispositivo conectado tem a sua propria struct
+struct smartlamp {
+    struct usb_device *udev;            // ponteiro para o disp. usb fisico, NULL apos desconectar
+    struct usb_interface *interface;
+    uint usb_in, usb_out;
+    char *usb_in_buffer, *usb_out_buffer; // enviar comandos e receber respostas
+    struct urb *out_urb;                // envio assincrono da atualizacao em grupo
+    struct completion out_done;         // out_urb terminou, com o resultado em out_status
+    int out_status;
+    int usb_max_size;
+    int id;                             // numero da lampada, usado no nome lampN
+    struct kobject *kobj;               // representa o dir /sys/kernel/smartlamp/lampN
+    struct mutex io_mutex;              // apenas uma transacao por vez em cada lampada
+    u64 sent_ns;                        // instante em que o ultimo comando terminou de ser enviado
+    struct smartlamp_clock clock;       // alterado com io_mutex e sample_lock travados
+    struct smartlamp_sample samples[SL_SENSOR_COUNT];
+    u64 notify_ns[SL_SENSOR_COUNT];     // ktime_get_ns() do ultimo aviso ao poll() de cada sensor
+    spinlock_t sample_lock;             // protege samples, notify_ns e clock, lidos sem esperar a USB
+    struct smartlamp_event_config event_config[SL_SENSOR_COUNT]; // protegido pelo io_mutex
+
+    // Leitura assincrona: um URB fica sempre pendente no endpoint de entrada, monta e
+    // decodifica as linhas que chegam. Respostas "RES"/"ERR" acordam quem esta esperando no
+    // smartlamp_recv, e avisos "EVT" vao para a fila da event_work.
+    struct urb *in_urb;
+    spinlock_t rx_lock;                 // protege os campos abaixo, usados no callback do URB
+    bool rx_running;                    // false depois que o URB parou (desconexao ou erro)
+    char rx_line[SL_MAX_BATCH_LINE];    // linha sendo montada, os lotes "BAT" sao as maiores
+    int rx_len;
+    bool rx_overflow;                   // linha maior que rx_line, descartada ate o proximo '\n'
+    unsigned long rx_dropped_lines;     // linhas descartadas por serem grandes demais
+    struct sl_msg response;             // ultima resposta recebida
+    bool response_ready;
+    wait_queue_head_t response_wait;
+    struct sl_msg event_msgs[EVENT_QUEUE_LEN];
+    int event_head, event_count;
+    struct work_struct event_work;
+    // lotes "BAT ..." ficam como texto ate a event_work decodificar todos os registros de uma vez
+    char batch_lines[BATCH_QUEUE_LEN][SL_MAX_BATCH_LINE];
+    u16 batch_line_len[BATCH_QUEUE_LEN];
+    int batch_head, batch_count;
+    unsigned int batch_period_ms;       // configuracao do SET_BATCH, protegida pelo io_mutex
+    unsigned int batch_records;
+    bool recovering;                    // recuperacao em andamento, alterado com rx_lock travado
+    struct delayed_work recover_work;
+    unsigned int recover_delay_ms;      // intervalo ate a proxima tentativa se a atual falhar
+
+    // Escalonador: sched_busy indica que alguem esta com a vez, os outros esperam em
+    // sched_queue[prio]. Protegidos por sched_lock.
+    spinlock_t sched_lock;
+    bool sched_busy;
+    struct list_head sched_queue[SMARTLAMP_PRIO_COUNT];
+    wait_queue_head_t sched_wait;
+    // Leituras periodicas: poll_work so eh agendada com poll_lock travado e disconnected falso,
+    // assim uma escrita no arquivo poll durante a desconexao nao agenda a work de novo
+    spinlock_t poll_lock;
+    unsigned int poll_ms;               // intervalo das leituras periodicas, 0 = desligadas
+    bool disconnected;
+    struct delayed_work poll_work;
+    struct kref kref;
+    struct list_head node;
+};
+
+// Um pedido esperando a vez no escalonador, fica na pilha de quem espera
+struct smartlamp_waiter {
+    struct list_head node;
+    u64 deadline_ns;    // ktime_get_ns() limite para comecar, 0 = sem prazo
+    bool granted;       // recebeu a vez
+    bool dropped;       // descartado porque o prazo passou
+};
 
 // --- Variáveis Globais ---
-static struct usb_device *smartlamp_device; // ponteiro para armazenar a ref do disp. usb fisico quando eh  conectado
-static uint usb_in, usb_out;
-static char *usb_in_buffer, *usb_out_buffer; // enviar comandos e receber respostas
-static int usb_max_size;
-int LDR_value = 0;
 static struct kobject *smartlamp_kobj; // adicionado para sysfs, representa dir /sys/kernel/smartlamp
+static LIST_HEAD(smartlamp_list);      // lampadas conectadas, ordenadas pelo id
+static DEFINE_MUTEX(smartlamp_list_mutex);
+static DEFINE_MUTEX(smartlamp_group_mutex); // serializa as atualizacoes em grupo
+// lampadas que nao confirmaram o novo valor na ultima atualizacao em grupo (arquivo group),
+// protegidas pelo smartlamp_group_mutex
+static int smartlamp_group_failed[MAX_GROUP_LAMPS];
+static int smartlamp_group_failed_count;
+static DEFINE_IDA(smartlamp_ida);
 
 // --- Comandos de Controle para o Chip CP210x ---
 #define CP210X_IFC_ENABLE 0x00
+#define CP210X_SET_BAUDRATE 0x1E
 #define UART_ENABLE 0x01
 
 // --- Configuração do Dispositivo USB ---
@@ -34,33 +188,88 @@ MODULE_DEVICE_TABLE(usb, id_table);
 // kobj_attribute define um arquivo no sysfs
 static int  usb_probe(struct usb_interface *ifce, const struct usb_device_id *id);
 static void usb_disconnect(struct usb_interface *ifce);
-static int  smartlamp_transaction(const char* command, char *response_buf); // funcao de comunicacao unificada
+static int  usb_pre_reset(struct usb_interface *ifce);
+static int  usb_post_reset(struct usb_interface *ifce);
+static int  smartlamp_send(struct smartlamp *lamp, const char *command);
+static int  smartlamp_recv(struct smartlamp *lamp, int cmd, struct sl_msg *response);
+static int  smartlamp_transaction(struct smartlamp *lamp, int prio, u64 deadline_ns, int cmd, const char *command, struct sl_msg *response); // funcao de comunicacao unificada
 static ssize_t led_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
 static ssize_t led_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count);
-static ssize_t temp_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
-static ssize_t hum_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
-static ssize_t ldr_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t sensor_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t group_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t group_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t samples_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t events_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t events_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t poll_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t poll_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t batch_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t batch_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count);
+static void smartlamp_genl_sample(struct smartlamp *lamp, int sensor, const struct smartlamp_sample *sample);
+static void smartlamp_genl_led(struct smartlamp *lamp, int value);
+static void smartlamp_genl_state(struct smartlamp *lamp, int state);
+struct smartlamp_genl_batch;
+static void smartlamp_genl_batch_init(struct smartlamp_genl_batch *msgs);
+static void smartlamp_genl_batch_add(struct smartlamp_genl_batch *msgs, struct smartlamp *lamp, int sensor,
+                                     const struct smartlamp_sample *sample);
+static void smartlamp_genl_batch_send(struct smartlamp_genl_batch *msgs);
+static int  smartlamp_genl_get_samples(struct sk_buff *skb, struct netlink_callback *cb);
+static int  smartlamp_genl_get_sensor(struct sk_buff *skb, struct genl_info *info);
+static int  smartlamp_genl_get_led(struct sk_buff *skb, struct genl_info *info);
+static int  smartlamp_genl_set_led(struct sk_buff *skb, struct genl_info *info);
 
 
 // --- Definições do Sysfs (Adicionado) ---
 // __attr eh um macro que junta o nome do arquivo, as permissoes e as funcoes que vao ser chamada pra ler e escrever
 static struct kobj_attribute led_attribute = __ATTR(led, 0664, led_show, led_store);
-static struct kobj_attribute temp_attribute = __ATTR(temp, 0444, temp_show, NULL);  // TAREFA 5: attr de temperatura
-static struct kobj_attribute hum_attribute = __ATTR(hum, 0444, hum_show, NULL);   // TAREFA 5: attr de umidade
-static struct kobj_attribute ldr_attribute = __ATTR(ldr, 0444, ldr_show, NULL);   // TAREFA 5: attr do ldr
+// um arquivo por sensor da tabela SL_SENSORS (ldr, temp, hum, ...)
+static struct kobj_attribute sensor_attributes[SL_SENSOR_COUNT] = {
+#define SL_X(id, sysfs_name, scale, period_ms, read) [SL_SENSOR_##id] = { .attr = { .name = sysfs_name, .mode = 0444 }, .show = sensor_show },
+    SL_SENSORS(SL_X)
+#undef SL_X
+};
+static struct kobj_attribute group_attribute = __ATTR(group, 0664, group_show, group_store); // brilho de varias lampadas de uma vez
+static struct kobj_attribute samples_attribute = __ATTR(samples, 0444, samples_show, NULL); // ultimas amostras com horario
+static struct kobj_attribute events_attribute = __ATTR(events, 0664, events_show, events_store); // quando o firmware avisa mudancas
+static struct kobj_attribute poll_attribute = __ATTR(poll, 0664, poll_show, poll_store); // leituras periodicas em segundo plano
+static struct kobj_attribute batch_attribute = __ATTR(batch, 0664, batch_show, batch_store); // lotes de amostras do firmware
+
 
+// arquivos de cada lampada, em /sys/kernel/smartlamp/lampN
+static struct attribute *lamp_attrs[] = {
+    &led_attribute.attr,
+#define SL_X(id, sysfs_name, scale, period_ms, read) &sensor_attributes[SL_SENSOR_##id].attr,
+    SL_SENSORS(SL_X)
+#undef SL_X
+    &samples_attribute.attr,
+    &events_attribute.attr,
+    &poll_attribute.attr,
+    &batch_attribute.attr,
+    NULL, // Fim da lista
+};
 
-static struct attribute *attrs[] = {
+// arquivos do dir raiz /sys/kernel/smartlamp
+// led e os sensores continuam aqui e acessam a primeira lampada conectada
+static struct attribute *root_attrs[] = {
     &led_attribute.attr,
-    &temp_attribute.attr, // TAREFA 5: Adiciona temp a lista
-    &hum_attribute.attr,  // TAREFA 5: Adiciona hum a lista
-    &ldr_attribute.attr, // TAREFA 5: Adiciona ldr a lista
+#define SL_X(id, sysfs_name, scale, period_ms, read) &sensor_attributes[SL_SENSOR_##id].attr,
+    SL_SENSORS(SL_X)
+#undef SL_X
+    &samples_attribute.attr,
+    &events_attribute.attr,
+    &poll_attribute.attr,
+    &batch_attribute.attr,
+    &group_attribute.attr,
     NULL, // Fim da lista
 };
 
 // attribute_group agrupa todos os arquivos para criar de uma so vez
-static struct attribute_group attr_group = {
-    .attrs = attrs,
+static struct attribute_group lamp_attr_group = {
+    .attrs = lamp_attrs,
+};
+
+static struct attribute_group root_attr_group = {
+    .attrs = root_attrs,
 };
 
 
@@ -70,9 +279,95 @@ static struct usb_driver smartlamp_driver = {
     .name        = "smartlamp",
     .probe       = usb_probe,
     .disconnect  = usb_disconnect,
+    .pre_reset   = usb_pre_reset,   // reset feito pela recuperacao, sem desconectar a lampada
+    .post_reset  = usb_post_reset,
     .id_table    = id_table,
 };
-module_usb_driver(smartlamp_driver);
+
+
+// --- Familia Generic Netlink ---
+// Os mesmos dados do sysfs para varios programas ao mesmo tempo, ver smartlamp_genl.h
+static const struct nla_policy smartlamp_genl_policy[SMARTLAMP_ATTR_MAX + 1] = {
+    [SMARTLAMP_ATTR_LAMP]   = { .type = NLA_U32 },
+    [SMARTLAMP_ATTR_SENSOR] = NLA_POLICY_MAX(NLA_U32, SL_SENSOR_COUNT - 1),
+    [SMARTLAMP_ATTR_LED]    = { .type = NLA_U32 },
+};
+
+static const struct genl_ops smartlamp_genl_ops[] = {
+    { .cmd = SMARTLAMP_CMD_GET_SAMPLES, .dumpit = smartlamp_genl_get_samples },
+    { .cmd = SMARTLAMP_CMD_GET_SENSOR, .doit = smartlamp_genl_get_sensor },
+    { .cmd = SMARTLAMP_CMD_GET_LED, .doit = smartlamp_genl_get_led },
+    // mesma restricao do arquivo led, que so o root pode escrever
+    { .cmd = SMARTLAMP_CMD_SET_LED, .doit = smartlamp_genl_set_led, .flags = GENL_ADMIN_PERM },
+};
+
+static const struct genl_multicast_group smartlamp_genl_mcgrps[] = {
+    { .name = SMARTLAMP_GENL_MCGRP },
+};
+
+// Varias amostras juntas no mesmo skb (lotes do firmware), enviado quando enche ou no fim
+struct smartlamp_genl_batch {
+    struct sk_buff *skb;
+    bool listeners;
+};
+
+static struct genl_family smartlamp_genl_family = {
+    .name     = SMARTLAMP_GENL_NAME,
+    .version  = SMARTLAMP_GENL_VERSION,
+    .maxattr  = SMARTLAMP_ATTR_MAX,
+    .policy   = smartlamp_genl_policy,
+    .module   = THIS_MODULE,
+    // os comandos esperam a USB e cada um pega a sua referencia e as travas da lampada,
+    // entao nao precisam do genl_mutex, que travaria todas as familias generic netlink
+    .parallel_ops = true,
+    .ops      = smartlamp_genl_ops,
+    .n_ops    = ARRAY_SIZE(smartlamp_genl_ops),
+    .mcgrps   = smartlamp_genl_mcgrps,
+    .n_mcgrps = ARRAY_SIZE(smartlamp_genl_mcgrps),
+};
+
+// O dir /sys/kernel/smartlamp agora existe enquanto o modulo estiver carregado,
+// e cada lampada conectada ganha um subdir lampN dentro dele
+static int __init smartlamp_init(void) {
+    int ret;
+
+    sl_proto_init();
+
+    smartlamp_kobj = kobject_create_and_add("smartlamp", kernel_kobj);
+    if (!smartlamp_kobj) {
+        return -ENOMEM;
+    }
+
+    if (sysfs_create_group(smartlamp_kobj, &root_attr_group)) {
+        kobject_put(smartlamp_kobj);
+        return -ENOMEM;
+    }
+
+    // registrada antes do driver USB para que a primeira lampada ja seja anunciada
+    ret = genl_register_family(&smartlamp_genl_family);
+    if (ret) {
+        kobject_put(smartlamp_kobj);
+        return ret;
+    }
+
+    ret = usb_register(&smartlamp_driver);
+    if (ret) {
+        genl_unregister_family(&smartlamp_genl_family);
+        kobject_put(smartlamp_kobj);
+        return ret;
+    }
+    printk(KERN_INFO "SmartLamp: Interface sysfs criada em /sys/kernel/smartlamp\n");
+    return 0;
+}
+
+static void __exit smartlamp_exit(void) {
+    usb_deregister(&smartlamp_driver);
+    genl_unregister_family(&smartlamp_genl_family);
+    kobject_put(smartlamp_kobj);
+}
+
+module_init(smartlamp_init);
+module_exit(smartlamp_exit);
 
 /*
 
@@ -83,101 +378,1194 @@ echo "75" | sudo tee /sys/kernel/smartlamp/led     = ALTERAR o valor do led
 cat /sys/kernel/smartlamp/temp                     = LER o valro da temperatura
 cat /sys/kernel/smartlamp/hum                      = LER o valor da umidade
 cat /sys/kernel/smartlamp/ldr                      = LER o valor do LDR
+cat /sys/kernel/smartlamp/lamp1/ldr                = LER o valor do LDR da lampada 1
+cat /sys/kernel/smartlamp/samples                  = ultimas amostras lidas, com o horario (ns, CLOCK_MONOTONIC)
+echo "ldr 5" | sudo tee /sys/kernel/smartlamp/events          = avisar quando o LDR mudar 5 ou mais
+echo "temp 0.5 30 1" | sudo tee /sys/kernel/smartlamp/events  = avisar a cada 0.5 grau e ao passar de 31 / voltar abaixo de 29
+                                                     os arquivos ldr/temp/hum/samples acordam poll()/select() a cada aviso,
+                                                     e ler o arquivo logo depois devolve o valor avisado sem acessar a USB
+echo "0=75 1=30 2=100" | sudo tee /sys/kernel/smartlamp/group = ALTERAR varias lampadas juntas
+echo 1000 | sudo tee /sys/kernel/smartlamp/lamp0/poll          = ler os sensores a cada 1 s em segundo plano (0 desliga),
+                                                     sem atrasar os comandos do usuario
+echo "50 32" | sudo tee /sys/kernel/smartlamp/lamp0/batch      = firmware le os sensores a cada 50 ms e envia 32 leituras
+                                                     por vez em uma linha compactada (0 desliga)
+genl-ctrl-list | grep smartlamp                    = familia netlink "smartlamp", amostras e mudancas de estado
+                                                     para todos os inscritos no grupo "events"
 
 */
 
-// TAREFA 5: Função unificada para enviar um comando e receber a resposta
-// Na tentativa de simplificar o codigo
-// foi criado essa funcao principal para o driver
-static int smartlamp_transaction(const char* command, char *response_buf) {
+// --- Gerenciamento das lampadas ---
+
+static void smartlamp_release(struct kref *kref) {
+    struct smartlamp *lamp = container_of(kref, struct smartlamp, kref);
+
+    //libera a memoria dos buffers
+    usb_free_urb(lamp->in_urb);
+    usb_free_urb(lamp->out_urb);
+    kfree(lamp->usb_in_buffer);
+    kfree(lamp->usb_out_buffer);
+    kfree(lamp);
+}
+
+static void smartlamp_put(struct smartlamp *lamp) {
+    kref_put(&lamp->kref, smartlamp_release);
+}
+
+// Encontra a lampada dona de um kobject do sysfs e pega uma referencia para ela
+// o dir raiz /sys/kernel/smartlamp aponta para a primeira lampada da lista
+static struct smartlamp *smartlamp_get_by_kobj(struct kobject *kobj) {
+    struct smartlamp *lamp, *found = NULL;
+
+    mutex_lock(&smartlamp_list_mutex);
+    list_for_each_entry(lamp, &smartlamp_list, node) {
+        if (kobj == smartlamp_kobj || lamp->kobj == kobj) {
+            found = lamp;
+            kref_get(&found->kref);
+            break;
+        }
+    }
+    mutex_unlock(&smartlamp_list_mutex);
+    return found;
+}
+
+// Encontra a lampada lampN e pega uma referencia para ela
+static struct smartlamp *smartlamp_get_by_id(int id) {
+    struct smartlamp *lamp, *found = NULL;
+
+    mutex_lock(&smartlamp_list_mutex);
+    list_for_each_entry(lamp, &smartlamp_list, node) {
+        if (lamp->id == id) {
+            found = lamp;
+            kref_get(&found->kref);
+            break;
+        }
+    }
+    mutex_unlock(&smartlamp_list_mutex);
+    return found;
+}
+
+// --- Comunicacao com a lampada ---
+// a transacao foi dividida em envio e leitura da resposta, assim a atualizacao
+// em grupo consegue enviar para todas as lampadas antes de esperar pelas respostas.
+// As duas funcoes devem ser chamadas com lamp->io_mutex travado.
+
+static void smartlamp_recover(struct smartlamp *lamp);
+
+// Ativa a UART e escreve a linha no endpoint de saida, sem olhar o estado da recuperacao
+static int smartlamp_write(struct smartlamp *lamp, const char *command) {
     int ret, actual_size;
-    int retries = 5;
+
+    // descarta uma resposta que tenha chegado atrasada de um comando anterior
+    spin_lock_irq(&lamp->rx_lock);
+    lamp->response_ready = false;
+    spin_unlock_irq(&lamp->rx_lock);
 
     // Ativa a UART para garantir que o dispositivo está pronto
-    ret = usb_control_msg(smartlamp_device, usb_sndctrlpipe(smartlamp_device, 0),
+    ret = usb_control_msg(lamp->udev, usb_sndctrlpipe(lamp->udev, 0),
                           CP210X_IFC_ENABLE, 0x41, UART_ENABLE,
-                          smartlamp_device->actconfig->interface[0]->altsetting[0].desc.bInterfaceNumber,
-                          NULL, 0, 1000);
+                          lamp->interface->cur_altsetting->desc.bInterfaceNumber,
+                          NULL, 0, USB_TIMEOUT_MS);
     if (ret < 0) { printk(KERN_ERR "SmartLamp: Falha ao ativar a UART. Erro: %d\n", ret); return ret; }
 
     // Envia o comando
     // usa o usbbulkmsg com usbsendbulkpipe para enviar o comando solicitado
-    strncpy(usb_out_buffer, command, usb_max_size);
-    ret = usb_bulk_msg(smartlamp_device, usb_sndbulkpipe(smartlamp_device, usb_out),
-                       usb_out_buffer, strlen(command), &actual_size, 1000);
+    strscpy(lamp->usb_out_buffer, command, lamp->usb_max_size);
+    ret = usb_bulk_msg(lamp->udev, usb_sndbulkpipe(lamp->udev, lamp->usb_out),
+                       lamp->usb_out_buffer, strlen(lamp->usb_out_buffer), &actual_size, USB_TIMEOUT_MS);
     if (ret) { printk(KERN_ERR "SmartLamp: Falha ao enviar comando '%s'. Erro: %d\n", command, ret); return ret; }
+    lamp->sent_ns = ktime_get_ns();
 
-    msleep(100);
+    return 0;
+}
 
-    // Tenta ler a resposta em um laço para lidar com erros como EAGAIN (-11)
-    // assim, caso o disp. por algum motive nao responder, ele vai  tentar de novo
-    while (retries-- > 0) {
-        ret = usb_bulk_msg(smartlamp_device, usb_rcvbulkpipe(smartlamp_device, usb_in),
-                           response_buf, MAX_RECV_LINE - 1, &actual_size, 1000);
-        if (ret == 0) {
-            response_buf[actual_size] = '\0';
+// Envia o comando, ou falha na hora com -ETIMEDOUT se a lampada estiver em recuperacao
+static int smartlamp_send(struct smartlamp *lamp, const char *command) {
+    int ret;
+
+    if (!lamp->udev) return -ENODEV;
+    if (lamp->recovering) return -ETIMEDOUT;
+    if (!lamp->rx_running) return -EIO;
+
+    ret = smartlamp_write(lamp, command);
+    if (ret && ret != -ENODEV && ret != -ESHUTDOWN) {
+        smartlamp_recover(lamp); // endpoint travado (-EPIPE) ou sem resposta da USB (-ETIMEDOUT)
+    }
+    return ret;
+}
+
+// Envio assincrono, usado pela atualizacao em grupo para enviar a todas as lampadas ao
+// mesmo tempo: smartlamp_send_async submete o URB e volta na hora, smartlamp_send_wait
+// espera ele terminar. Nao reativa a UART como o smartlamp_write, ela ja foi ativada pelo
+// smartlamp_rx_start. Tambem devem ser chamadas com lamp->io_mutex travado.
+static void smartlamp_tx_complete(struct urb *urb) {
+    struct smartlamp *lamp = urb->context;
+
+    lamp->out_status = urb->status;
+    if (urb->status == 0) lamp->sent_ns = ktime_get_ns();
+    complete(&lamp->out_done);
+}
+
+static int smartlamp_send_async(struct smartlamp *lamp, const char *command) {
+    int ret;
+
+    if (!lamp->udev) return -ENODEV;
+    if (lamp->recovering) return -ETIMEDOUT;
+    if (!lamp->rx_running) return -EIO;
+
+    spin_lock_irq(&lamp->rx_lock);
+    lamp->response_ready = false;
+    spin_unlock_irq(&lamp->rx_lock);
+
+    strscpy(lamp->usb_out_buffer, command, lamp->usb_max_size);
+    usb_fill_bulk_urb(lamp->out_urb, lamp->udev, usb_sndbulkpipe(lamp->udev, lamp->usb_out),
+                      lamp->usb_out_buffer, strlen(lamp->usb_out_buffer), smartlamp_tx_complete, lamp);
+    reinit_completion(&lamp->out_done);
+    ret = usb_submit_urb(lamp->out_urb, GFP_KERNEL);
+    if (ret) {
+        printk(KERN_ERR "SmartLamp: Falha ao enviar comando '%s'. Erro: %d\n", command, ret);
+        if (ret != -ENODEV && ret != -ESHUTDOWN) smartlamp_recover(lamp);
+    }
+    return ret;
+}
+
+static int smartlamp_send_wait(struct smartlamp *lamp) {
+    int ret;
+
+    if (wait_for_completion_timeout(&lamp->out_done, msecs_to_jiffies(USB_TIMEOUT_MS))) {
+        ret = lamp->out_status;
+    } else {
+        usb_kill_urb(lamp->out_urb);
+        ret = -ETIMEDOUT;
+    }
+    if (ret) {
+        printk(KERN_ERR "SmartLamp: lamp%d: falha no envio. Erro: %d\n", lamp->id, ret);
+        if (ret != -ENODEV && ret != -ESHUTDOWN) smartlamp_recover(lamp);
+    }
+    return ret;
+}
+
+// Espera a resposta do comando cmd, ja enviado, e copia para *response.
+// A linha eh montada pelo URB de entrada, entao nao ha mais msleep nem tentativas de leitura:
+// a funcao retorna assim que a resposta chega. Respostas que nao sao deste comando sao descartadas.
+// Com fail_fast, desiste assim que uma recuperacao comecar.
+static int smartlamp_wait_response(struct smartlamp *lamp, int cmd, struct sl_msg *response,
+                                   unsigned int timeout_ms, bool fail_fast) {
+    unsigned long deadline = jiffies + msecs_to_jiffies(timeout_ms);
+    bool got, running, recovering;
+    long remaining;
+
+    while ((remaining = (long)(deadline - jiffies)) > 0) {
+        wait_event_timeout(lamp->response_wait,
+                           lamp->response_ready || !lamp->rx_running || (fail_fast && lamp->recovering),
+                           remaining);
+
+        spin_lock_irq(&lamp->rx_lock);
+        got = lamp->response_ready;
+        running = lamp->rx_running;
+        recovering = lamp->recovering;
+        if (got) {
+            *response = lamp->response;
+            lamp->response_ready = false;
+        }
+        spin_unlock_irq(&lamp->rx_lock);
+
+        if (!got) {
+            if (fail_fast && recovering) return -ETIMEDOUT;
+            if (!running) return -EIO;
+            continue;
+        }
+        // "ERR <texto>" sem nome de comando eh aceito como resposta ao comando atual
+        if (response->cmd == cmd || (response->kind == SL_MSG_ERR && response->cmd == SL_NONE)) {
             return 0; // Sucesso
         }
-        msleep(50); // intervalo
     }
-    printk(KERN_ERR "SmartLamp: Falha ao ler resposta para '%s'. Erro final: %d\n", command, ret);
+    printk(KERN_ERR "SmartLamp: Falha ao ler resposta para '%s'. Erro final: %d\n", sl_cmds[cmd].name, -ETIMEDOUT);
+    return -ETIMEDOUT;
+}
+
+static int smartlamp_recv(struct smartlamp *lamp, int cmd, struct sl_msg *response) {
+    int ret = smartlamp_wait_response(lamp, cmd, response, RESPONSE_TIMEOUT_MS, true);
+
+    // a lampada nao respondeu: os proximos comandos falham na hora ate ela se recuperar
+    if (ret == -ETIMEDOUT) smartlamp_recover(lamp);
+    return ret;
+}
+
+// Processa uma linha completa recebida do firmware, chamada com rx_lock travado
+static void smartlamp_rx_line(struct smartlamp *lamp) {
+    struct sl_msg msg;
+    int slot;
+
+    if (sl_parse_line(lamp->rx_line, lamp->rx_len, &msg) < 0) {
+        // outras linhas (mensagem de inicializacao do firmware, lixo) sao ignoradas
+    } else if (msg.kind == SL_MSG_EVT) {
+        // se a fila estiver cheia o aviso eh perdido, a amostra seguinte corrige o valor
+        if (lamp->event_count < EVENT_QUEUE_LEN) {
+            slot = (lamp->event_head + lamp->event_count) % EVENT_QUEUE_LEN;
+            lamp->event_msgs[slot] = msg;
+            lamp->event_count++;
+        }
+        schedule_work(&lamp->event_work);
+    } else if (msg.kind == SL_MSG_BAT) {
+        // com a fila cheia o lote eh perdido: a event_work esta atrasada mais de BATCH_QUEUE_LEN lotes
+        if (lamp->batch_count < BATCH_QUEUE_LEN) {
+            slot = (lamp->batch_head + lamp->batch_count) % BATCH_QUEUE_LEN;
+            memcpy(lamp->batch_lines[slot], lamp->rx_line, lamp->rx_len);
+            lamp->batch_line_len[slot] = lamp->rx_len;
+            lamp->batch_count++;
+        } else {
+            printk_ratelimited(KERN_WARNING "SmartLamp: lamp%d: lote de amostras perdido\n", lamp->id);
+        }
+        schedule_work(&lamp->event_work);
+    } else {
+        lamp->response = msg;
+        lamp->response_ready = true;
+        wake_up(&lamp->response_wait);
+    }
+    lamp->rx_len = 0;
+}
+
+// Marca a leitura como parada e acorda quem estiver esperando resposta
+static void smartlamp_rx_stop(struct smartlamp *lamp) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&lamp->rx_lock, flags);
+    lamp->rx_running = false;
+    spin_unlock_irqrestore(&lamp->rx_lock, flags);
+    wake_up(&lamp->response_wait);
+}
+
+// Callback do URB de entrada, roda em contexto de interrupcao
+static void smartlamp_rx_complete(struct urb *urb) {
+    struct smartlamp *lamp = urb->context;
+    unsigned long flags;
+    int i, ret;
+
+    switch (urb->status) {
+    case 0:
+        break;
+    case -ENOENT:
+    case -ECONNRESET:
+    case -ESHUTDOWN:
+        // URB cancelado ou dispositivo removido
+        printk(KERN_DEBUG "SmartLamp: leitura parada. Status: %d\n", urb->status);
+        smartlamp_rx_stop(lamp);
+        return;
+    case -EPIPE:
+        // endpoint travado, a recuperacao limpa o halt e recomeca a leitura
+        printk(KERN_WARNING "SmartLamp: endpoint de entrada travado\n");
+        smartlamp_rx_stop(lamp);
+        smartlamp_recover(lamp);
+        return;
+    default:
+        // erro transitorio, descarta os dados e continua lendo
+        goto resubmit;
+    }
+
+    spin_lock_irqsave(&lamp->rx_lock, flags);
+    for (i = 0; i < urb->actual_length; i++) {
+        char c = lamp->usb_in_buffer[i];
+        if (c == '\n' && lamp->rx_overflow) {
+            // uma linha cortada poderia ser decodificada como outra mensagem (um lote pela
+            // metade, um valor truncado), entao ela eh descartada inteira
+            lamp->rx_overflow = false;
+            lamp->rx_len = 0;
+            lamp->rx_dropped_lines++;
+            printk_ratelimited(KERN_WARNING "SmartLamp: lamp%d: linha grande demais descartada (%lu no total)\n",
+                               lamp->id, lamp->rx_dropped_lines);
+        } else if (c == '\n') {
+            smartlamp_rx_line(lamp);
+        } else if (!lamp->rx_overflow) {
+            if (lamp->rx_len < SL_MAX_BATCH_LINE - 1) lamp->rx_line[lamp->rx_len++] = c;
+            else lamp->rx_overflow = true; // descarta ate o fim da linha
+        }
+    }
+    spin_unlock_irqrestore(&lamp->rx_lock, flags);
+
+resubmit:
+    ret = usb_submit_urb(urb, GFP_ATOMIC);
+    if (ret) {
+        printk(KERN_ERR "SmartLamp: Falha ao continuar a leitura. Erro: %d\n", ret);
+        smartlamp_rx_stop(lamp);
+        if (ret != -ENODEV && ret != -EPERM) smartlamp_recover(lamp);
+    }
+}
+
+// Ativa a UART e configura o baud rate do CP210x. Depois de um reset o chip volta a
+// configuracao padrao e deixaria de entender o firmware, entao um erro aqui eh uma falha
+// da lampada e nao so um aviso.
+static int smartlamp_uart_setup(struct smartlamp *lamp) {
+    __le32 baud = cpu_to_le32(UART_BAUD_RATE);
+    u16 ifnum = lamp->interface->cur_altsetting->desc.bInterfaceNumber;
+    int ret;
+
+    ret = usb_control_msg_send(lamp->udev, 0, CP210X_IFC_ENABLE, 0x41, UART_ENABLE, ifnum,
+                               NULL, 0, USB_TIMEOUT_MS, GFP_KERNEL);
+    if (ret) {
+        printk(KERN_ERR "SmartLamp: Falha ao ativar a UART. Erro: %d\n", ret);
+        return ret;
+    }
+    ret = usb_control_msg_send(lamp->udev, 0, CP210X_SET_BAUDRATE, 0x41, 0, ifnum,
+                               &baud, sizeof(baud), USB_TIMEOUT_MS, GFP_KERNEL);
+    if (ret) printk(KERN_ERR "SmartLamp: Falha ao configurar o baud rate. Erro: %d\n", ret);
+    return ret;
+}
+
+// Configura a UART e comeca a leitura assincrona do endpoint de entrada.
+// Se a UART nao puder ser configurada a leitura fica parada e o erro eh retornado.
+static int smartlamp_rx_start(struct smartlamp *lamp) {
+    int ret;
+
+    ret = smartlamp_uart_setup(lamp);
+    if (ret) {
+        smartlamp_rx_stop(lamp);
+        return ret;
+    }
+
+    usb_fill_bulk_urb(lamp->in_urb, lamp->udev, usb_rcvbulkpipe(lamp->udev, lamp->usb_in),
+                      lamp->usb_in_buffer, lamp->usb_max_size, smartlamp_rx_complete, lamp);
+
+    spin_lock_irq(&lamp->rx_lock);
+    lamp->rx_running = true;
+    lamp->rx_len = 0;
+    lamp->rx_overflow = false;
+    lamp->response_ready = false;
+    spin_unlock_irq(&lamp->rx_lock);
+
+    ret = usb_submit_urb(lamp->in_urb, GFP_KERNEL);
+    if (ret) {
+        printk(KERN_ERR "SmartLamp: Falha ao iniciar a leitura. Erro: %d\n", ret);
+        smartlamp_rx_stop(lamp);
+    }
+    return ret;
+}
+
+// --- Escalonador de comandos ---
+
+// Passa a vez para o proximo pedido: o primeiro da classe mais urgente, descartando os que
+// ja passaram do prazo. Chamada com sched_lock travado.
+static void smartlamp_sched_next_locked(struct smartlamp *lamp) {
+    struct smartlamp_waiter *waiter, *tmp;
+    u64 now = ktime_get_ns();
+    int prio;
+
+    lamp->sched_busy = false;
+    for (prio = 0; prio < SMARTLAMP_PRIO_COUNT && !lamp->sched_busy; prio++) {
+        list_for_each_entry_safe(waiter, tmp, &lamp->sched_queue[prio], node) {
+            list_del_init(&waiter->node);
+            if (waiter->deadline_ns && now > waiter->deadline_ns) {
+                waiter->dropped = true; // atrasado, desiste sem ir para a USB
+                continue;
+            }
+            waiter->granted = true;
+            lamp->sched_busy = true;
+            break;
+        }
+    }
+    wake_up_all(&lamp->sched_wait);
+}
+
+// Espera a vez na fila da classe prio. Retorna -ETIMEDOUT se o prazo passar antes
+// (deadline_ns = 0 espera sem prazo) ou se a lampada estiver em recuperacao.
+static int smartlamp_sched_wait(struct smartlamp *lamp, int prio, u64 deadline_ns) {
+    struct smartlamp_waiter waiter = { .deadline_ns = deadline_ns };
+    u64 now;
+    int ret = 0;
+
+    if (lamp->recovering) return -ETIMEDOUT;
+
+    spin_lock(&lamp->sched_lock);
+    if (!lamp->sched_busy) {
+        // ninguem com a vez, entao as filas estao vazias
+        lamp->sched_busy = true;
+        spin_unlock(&lamp->sched_lock);
+        return 0;
+    }
+    list_add_tail(&waiter.node, &lamp->sched_queue[prio]);
+    spin_unlock(&lamp->sched_lock);
+
+    if (deadline_ns) {
+        now = ktime_get_ns();
+        wait_event_timeout(lamp->sched_wait, waiter.granted || waiter.dropped || lamp->recovering,
+                           deadline_ns > now ? nsecs_to_jiffies(deadline_ns - now) + 1 : 0);
+    } else {
+        wait_event(lamp->sched_wait, waiter.granted || lamp->recovering);
+    }
+
+    spin_lock(&lamp->sched_lock);
+    if (!waiter.granted) {
+        list_del(&waiter.node); // ainda na fila, ou ja fora dela se foi descartado
+        ret = -ETIMEDOUT;
+    } else if (lamp->recovering) {
+        smartlamp_sched_next_locked(lamp);
+        ret = -ETIMEDOUT;
+    }
+    spin_unlock(&lamp->sched_lock);
+    return ret;
+}
+
+// Espera a vez e trava o io_mutex. Deve terminar com smartlamp_end().
+static int smartlamp_begin(struct smartlamp *lamp, int prio, u64 deadline_ns) {
+    int ret = smartlamp_sched_wait(lamp, prio, deadline_ns);
+
+    if (ret) return ret;
+    mutex_lock(&lamp->io_mutex);
+    return 0;
+}
+
+static void smartlamp_end(struct smartlamp *lamp) {
+    mutex_unlock(&lamp->io_mutex);
+    spin_lock(&lamp->sched_lock);
+    smartlamp_sched_next_locked(lamp);
+    spin_unlock(&lamp->sched_lock);
+}
+
+// Envia a linha command (do comando cmd) e espera a resposta, deve ser chamada com
+// lamp->io_mutex travado. Uma resposta "ERR" vira -EPROTO.
+static int smartlamp_transaction_locked(struct smartlamp *lamp, int cmd, const char *command, struct sl_msg *response) {
+    int ret;
+
+    ret = smartlamp_send(lamp, command);
+    if (ret == 0) {
+        ret = smartlamp_recv(lamp, cmd, response);
+    }
+    if (ret == 0 && response->kind == SL_MSG_ERR) {
+        ret = -EPROTO;
+    }
+    return ret;
+}
+
+// --- Relogio do firmware ---
+// O firmware marca cada amostra com o seu proprio relogio (us desde o boot).
+// O driver mantem uma estimativa de offset e drift entre esse relogio e o
+// CLOCK_MONOTONIC do host, e converte o horario de cada amostra. Assim o horario
+// nao depende de quanto tempo a resposta levou para chegar (msleep, tentativas, ...).
+
+// Converte um horario do firmware para o relogio do host
+static u64 smartlamp_clock_to_host(const struct smartlamp_clock *clock, s64 dev_ns) {
+    s64 correction = div64_s64(div_s64(dev_ns - clock->ref_dev_ns, 1000) * clock->drift_ppb, 1000000);
+    return dev_ns + clock->offset_ns + correction;
+}
+
+// Atualiza a estimativa com um novo par (horario do firmware, horario do host).
+// O erro entre o previsto e o medido corrige metade do offset e um quarto do drift,
+// o que filtra o jitter da USB sem deixar a estimativa demorar a convergir.
+static void smartlamp_clock_update(struct smartlamp_clock *clock, s64 dev_ns, s64 host_ns) {
+    s64 predicted, error, elapsed;
+
+    elapsed = dev_ns - clock->ref_dev_ns;
+    predicted = smartlamp_clock_to_host(clock, dev_ns);
+    error = host_ns - predicted;
+
+    // primeira medida, firmware reiniciado ou erro grande demais: recomeca do zero
+    if (!clock->valid || elapsed <= 0 || abs(error) > NSEC_PER_SEC) {
+        clock->valid = true;
+        clock->offset_ns = host_ns - dev_ns;
+        clock->ref_dev_ns = dev_ns;
+        clock->drift_ppb = 0;
+        return;
+    }
+
+    if (elapsed >= NSEC_PER_SEC) {
+        clock->drift_ppb += div64_s64(error * NSEC_PER_SEC, elapsed) / 4;
+        clock->drift_ppb = clamp_t(s64, clock->drift_ppb, -CLOCK_MAX_DRIFT_PPB, CLOCK_MAX_DRIFT_PPB);
+    }
+    clock->offset_ns = predicted + error / 2 - dev_ns;
+    clock->ref_dev_ns = dev_ns;
+}
+
+// Atualiza a estimativa com a resposta de um GET_TIME enviado em uma linha de len bytes
+static void smartlamp_clock_apply(struct smartlamp *lamp, const struct sl_msg *response, size_t len) {
+    u64 host_ns = lamp->sent_ns + len * UART_NS_PER_BYTE;
+
+    spin_lock(&lamp->sample_lock);
+    smartlamp_clock_update(&lamp->clock, response->dev_us * NSEC_PER_USEC, host_ns);
+    spin_unlock(&lamp->sample_lock);
+    lamp->clock.last_sync_ns = ktime_get_ns();
+}
+
+// Pede o relogio do firmware com GET_TIME e atualiza a estimativa.
+// O horario do host usado eh o fim do envio mais o tempo do comando na UART,
+// que eh quando o firmware le o relogio; o tempo ate a resposta chegar nao entra na conta.
+static int smartlamp_clock_sync(struct smartlamp *lamp) {
+    char command[MAX_RECV_LINE];
+    struct sl_msg response;
+    size_t len = sl_encode_cmd(command, SL_CMD_GET_TIME);
+    int ret;
+
+    ret = smartlamp_transaction_locked(lamp, SL_CMD_GET_TIME, command, &response);
+    if (ret) {
+        // firmware antigo sem GET_TIME, tenta de novo so no proximo intervalo
+        lamp->clock.last_sync_ns = ktime_get_ns();
+        return ret;
+    }
+
+    smartlamp_clock_apply(lamp, &response, len);
+    return 0;
+}
+
+// TAREFA 5: Função unificada para enviar um comando e receber a resposta
+// Na tentativa de simplificar o codigo
+// foi criado essa funcao principal para o driver
+// prio eh a classe do pedido no escalonador (SMARTLAMP_PRIO_*), deadline_ns o prazo para
+// conseguir a vez (0 = sem prazo)
+static int smartlamp_transaction(struct smartlamp *lamp, int prio, u64 deadline_ns, int cmd, const char *command, struct sl_msg *response) {
+    int ret;
+
+    ret = smartlamp_begin(lamp, prio, deadline_ns);
+    if (ret) return ret;
+    ret = smartlamp_transaction_locked(lamp, cmd, command, response);
+    smartlamp_end(lamp);
+    return ret;
+}
+
+// Monta a amostra de uma resposta ou aviso ja decodificado, convertendo o horario do
+// firmware para o relogio do host. Sem o "@" (firmware antigo) o horario usado eh o atual.
+static int smartlamp_msg_to_sample(struct smartlamp *lamp, const struct sl_msg *msg, struct smartlamp_sample *sample) {
+    if (!msg->has_value) return -EPROTO;
+
+    sample->value = msg->value;
+    spin_lock(&lamp->sample_lock);
+    if (msg->has_time && lamp->clock.valid) {
+        sample->host_ns = smartlamp_clock_to_host(&lamp->clock, msg->dev_us * NSEC_PER_USEC);
+    } else {
+        sample->host_ns = ktime_get_ns();
+    }
+    spin_unlock(&lamp->sample_lock);
+    sample->valid = true;
+    return 0;
+}
+
+// Guarda a amostra e envia para os inscritos no netlink: cada leitura da USB, venha de
+// onde vier, chega uma vez so a todos os programas
+static void smartlamp_store_sample(struct smartlamp *lamp, int sensor, const struct smartlamp_sample *sample) {
+    spin_lock(&lamp->sample_lock);
+    lamp->samples[sensor] = *sample;
+    spin_unlock(&lamp->sample_lock);
+    smartlamp_genl_sample(lamp, sensor, sample);
+}
+
+// Le um sensor, guarda a amostra com o horario no relogio do host e devolve em *sample.
+// Respostas tem o formato "RES GET_<SENSOR> <valor> @<us do firmware>"
+// Se enquanto o pedido esperava a vez chegou uma amostra lida depois que ele foi feito
+// (outra leitura ou um aviso), ela eh usada e a USB nao eh acessada de novo: leituras
+// repetidas do mesmo sensor se juntam em uma so.
+static int smartlamp_read_sensor(struct smartlamp *lamp, int sensor, int prio, u64 deadline_ns,
+                                 struct smartlamp_sample *sample) {
+    char command[MAX_RECV_LINE];
+    struct sl_msg response;
+    int cmd = sl_sensor_cmd(sensor);
+    u64 requested_ns = ktime_get_ns();
+    bool fresh;
+    int ret;
+
+    sl_encode_cmd(command, cmd);
+
+    ret = smartlamp_begin(lamp, prio, deadline_ns);
+    if (ret) return ret;
+
+    spin_lock(&lamp->sample_lock);
+    *sample = lamp->samples[sensor];
+    spin_unlock(&lamp->sample_lock);
+    fresh = sample->valid && sample->host_ns >= requested_ns;
+    if (fresh) {
+        smartlamp_end(lamp);
+        return 0;
+    }
+
+    if (!lamp->clock.valid || ktime_get_ns() - lamp->clock.last_sync_ns > CLOCK_SYNC_INTERVAL_NS) {
+        smartlamp_clock_sync(lamp);
+    }
+
+    ret = smartlamp_transaction_locked(lamp, cmd, command, &response);
+    if (ret == 0) {
+        ret = smartlamp_msg_to_sample(lamp, &response, sample);
+    }
+    if (ret == 0) smartlamp_store_sample(lamp, sensor, sample);
+    smartlamp_end(lamp);
+    return ret;
+}
+
+// Acorda quem esta em poll()/select() nos arquivos do sensor. O dir raiz
+// tambem eh avisado quando a lampada eh a primeira da lista.
+// Quem acordou le o arquivo para rearmar o poll() e recebe a amostra avisada, sem outra
+// leitura na USB (ver smartlamp_notified_sample).
+static void smartlamp_notify_sensor(struct smartlamp *lamp, int sensor) {
+    bool first;
+
+    spin_lock(&lamp->sample_lock);
+    lamp->notify_ns[sensor] = ktime_get_ns();
+    spin_unlock(&lamp->sample_lock);
+
+    sysfs_notify(lamp->kobj, NULL, sl_sensors[sensor].name);
+    sysfs_notify(lamp->kobj, NULL, "samples");
+
+    mutex_lock(&smartlamp_list_mutex);
+    first = list_first_entry_or_null(&smartlamp_list, struct smartlamp, node) == lamp;
+    mutex_unlock(&smartlamp_list_mutex);
+    if (first) {
+        sysfs_notify(smartlamp_kobj, NULL, sl_sensors[sensor].name);
+        sysfs_notify(smartlamp_kobj, NULL, "samples");
+    }
+}
+
+// Decodifica um lote "BAT ..." inteiro de uma vez: os horarios sao convertidos com uma
+// unica copia do relogio, todas as amostras vao para o netlink juntas em poucos skbs, e so
+// a mais recente de cada sensor fica em samples. Quem esta em poll() nos arquivos eh
+// acordado uma vez por lote, nao por amostra.
+static void smartlamp_store_batch(struct smartlamp *lamp, const char *line, size_t len) {
+    struct smartlamp_sample latest[SL_SENSOR_COUNT] = {};
+    struct smartlamp_sample sample = { .valid = true };
+    struct smartlamp_genl_batch msgs;
+    struct smartlamp_clock clock;
+    struct sl_batch batch;
+    int sensor, records = 0, ret;
+
+    if (sl_batch_begin(&batch, line, len)) return;
+
+    spin_lock(&lamp->sample_lock);
+    clock = lamp->clock;
+    spin_unlock(&lamp->sample_lock);
+
+    smartlamp_genl_batch_init(&msgs);
+    while ((ret = sl_batch_next(&batch)) == 1) {
+        records++;
+        sample.host_ns = clock.valid ? smartlamp_clock_to_host(&clock, batch.dev_us * NSEC_PER_USEC) : ktime_get_ns();
+        for (sensor = 0; sensor < SL_SENSOR_COUNT; sensor++) {
+            if (!batch.valid[sensor]) continue;
+            sample.value = batch.value[sensor];
+            latest[sensor] = sample;
+            smartlamp_genl_batch_add(&msgs, lamp, sensor, &sample);
+        }
+    }
+    smartlamp_genl_batch_send(&msgs);
+    if (ret < 0) {
+        printk(KERN_WARNING "SmartLamp: lamp%d enviou um lote invalido, %d registros aproveitados\n", lamp->id, records);
+    }
+
+    // uma leitura feita enquanto o lote estava no firmware pode ser mais nova que o lote
+    spin_lock(&lamp->sample_lock);
+    for (sensor = 0; sensor < SL_SENSOR_COUNT; sensor++) {
+        if (!latest[sensor].valid) continue;
+        if (lamp->samples[sensor].valid && lamp->samples[sensor].host_ns > latest[sensor].host_ns) {
+            latest[sensor].valid = false;
+        } else {
+            lamp->samples[sensor] = latest[sensor];
+        }
+    }
+    spin_unlock(&lamp->sample_lock);
+
+    for (sensor = 0; sensor < SL_SENSOR_COUNT; sensor++) {
+        if (latest[sensor].valid) smartlamp_notify_sensor(lamp, sensor);
+    }
+}
+
+// Processa os avisos "EVT <SENSOR> <valor> @<us>" e os lotes "BAT ..." enviados pelo firmware.
+// Roda fora do contexto de interrupcao porque o sysfs_notify pode dormir.
+static void smartlamp_event_work(struct work_struct *work) {
+    struct smartlamp *lamp = container_of(work, struct smartlamp, event_work);
+    struct smartlamp_sample sample;
+    struct sl_msg msg;
+    int slot;
+
+    // o callback do URB so escreve nas posicoes livres da fila, entao o lote em batch_head
+    // pode ser lido sem copiar e so eh liberado depois de decodificado
+    for (;;) {
+        spin_lock_irq(&lamp->rx_lock);
+        if (lamp->batch_count == 0) {
+            spin_unlock_irq(&lamp->rx_lock);
+            break;
+        }
+        slot = lamp->batch_head;
+        spin_unlock_irq(&lamp->rx_lock);
+
+        smartlamp_store_batch(lamp, lamp->batch_lines[slot], lamp->batch_line_len[slot]);
+
+        spin_lock_irq(&lamp->rx_lock);
+        lamp->batch_head = (lamp->batch_head + 1) % BATCH_QUEUE_LEN;
+        lamp->batch_count--;
+        spin_unlock_irq(&lamp->rx_lock);
+    }
+
+    for (;;) {
+        spin_lock_irq(&lamp->rx_lock);
+        if (lamp->event_count == 0) {
+            spin_unlock_irq(&lamp->rx_lock);
+            break;
+        }
+        msg = lamp->event_msgs[lamp->event_head];
+        lamp->event_head = (lamp->event_head + 1) % EVENT_QUEUE_LEN;
+        lamp->event_count--;
+        spin_unlock_irq(&lamp->rx_lock);
+
+        if (smartlamp_msg_to_sample(lamp, &msg, &sample) == 0) {
+            smartlamp_store_sample(lamp, msg.sensor, &sample);
+            smartlamp_notify_sensor(lamp, msg.sensor);
+        }
+    }
+}
+
+// Le o brilho atual do LED, deadline_ns como no smartlamp_transaction
+static int smartlamp_get_led(struct smartlamp *lamp, u64 deadline_ns, int *value) {
+    char command[MAX_RECV_LINE];
+    struct sl_msg response;
+    int ret;
+
+    sl_encode_cmd(command, SL_CMD_GET_LED);
+    ret = smartlamp_transaction(lamp, SMARTLAMP_PRIO_ONDEMAND, deadline_ns, SL_CMD_GET_LED, command, &response);
+    if (ret) return ret;
+    if (!response.has_value) return -EPROTO;
+    *value = response.value;
+    return 0;
+}
+
+// Altera o brilho do LED, usado pelo arquivo led e pelo netlink.
+// Mudanca pedida pelo usuario, passa na frente das leituras que estiverem na fila.
+// Retorna -ETIMEDOUT sem resposta ou com a lampada em recuperacao, -EIO se a comunicacao
+// falhar e -EINVAL se o firmware recusar o valor. Os inscritos no netlink recebem o novo valor.
+// deadline_ns como no smartlamp_transaction.
+static int smartlamp_set_led(struct smartlamp *lamp, int value, u64 deadline_ns) {
+    char command[MAX_RECV_LINE];
+    struct sl_msg response;
+    int ret;
+
+    sl_encode_cmd_value(command, SL_CMD_SET_LED, value, 1);
+    ret = smartlamp_transaction(lamp, SMARTLAMP_PRIO_INTERACTIVE, deadline_ns, SL_CMD_SET_LED, command, &response);
+    if (ret == -ETIMEDOUT) return ret;
+    if (ret < 0) return -EIO;
+    // o firmware responde "RES SET_LED -1" para valores fora de 0..100
+    if (response.value != 1) return -EINVAL;
+
+    smartlamp_genl_led(lamp, value);
+    return 0;
+}
+
+// Envia o mesmo tipo de comando para as lampadas com todo[i] e so depois le as respostas.
+// Os envios sao submetidos todos antes de esperar por qualquer um, assim cada rodada leva
+// um envio e uma ida e volta, qualquer que seja o numero de lampadas.
+// Deve ser chamada com o io_mutex de todas as lampadas travado.
+// ok[i] diz se a lampada respondeu "RES <nome> 1". Retorna 0 se todas responderam.
+static int smartlamp_group_round(struct smartlamp **lamps, int *values, int n, int cmd,
+                                 const bool *todo, bool *ok) {
+    char command[MAX_RECV_LINE];
+    struct sl_msg response;
+    int i, ret = 0;
+
+    for (i = 0; i < n; i++) {
+        ok[i] = false;
+        if (!todo[i]) continue;
+        if (values) sl_encode_cmd_value(command, cmd, values[i], 1);
+        else sl_encode_cmd(command, cmd);
+        ok[i] = smartlamp_send_async(lamps[i], command) == 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (ok[i]) ok[i] = smartlamp_send_wait(lamps[i]) == 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!todo[i]) continue;
+        if (ok[i]) {
+            ok[i] = smartlamp_recv(lamps[i], cmd, &response) == 0 &&
+                    response.kind == SL_MSG_RES && response.value == 1;
+        }
+        if (!ok[i]) {
+            printk(KERN_ERR "SmartLamp: lamp%d falhou em %s\n", lamps[i]->id, sl_cmds[cmd].name);
+            ret = -EIO;
+        }
+    }
+    return ret;
+}
+
+// Atualiza o brilho de varias lampadas com duas rodadas paralelas:
+// PREP_LED guarda o novo valor em cada lampada sem aplicar, e COMMIT_LED aplica em
+// todas praticamente ao mesmo tempo. Se alguma falhar no PREP_LED, ABORT_LED descarta
+// os valores pendentes e nenhuma lampada muda. Se alguma falhar no COMMIT_LED, as outras
+// ja mudaram: ABORT_LED descarta o valor pendente nas que falharam, para ele nao ser
+// aplicado por um COMMIT_LED futuro.
+// applied[i] diz se a lampada confirmou o novo valor.
+static int smartlamp_group_set(struct smartlamp **lamps, int *values, int n, bool *applied) {
+    bool *todo, *ok;
+    int i, locked = 0, ret = 0;
+
+    for (i = 0; i < n; i++) applied[i] = false;
+    todo = kcalloc(2 * n, sizeof(*todo), GFP_KERNEL);
+    if (!todo) return -ENOMEM;
+    ok = todo + n;
+    for (i = 0; i < n; i++) todo[i] = true;
+
+    // pega a vez de cada lampada como um comando interativo, sempre na ordem da lista
+    mutex_lock(&smartlamp_group_mutex);
+    for (locked = 0; locked < n; locked++) {
+        ret = smartlamp_sched_wait(lamps[locked], SMARTLAMP_PRIO_INTERACTIVE, 0);
+        if (ret) goto out;
+        mutex_lock_nest_lock(&lamps[locked]->io_mutex, &smartlamp_group_mutex);
+    }
+
+    // nao comeca se alguma lampada estiver em recuperacao, nenhuma lampada muda
+    for (i = 0; i < n; i++) {
+        if (lamps[i]->recovering) {
+            ret = -ETIMEDOUT;
+            goto out;
+        }
+    }
+
+    ret = smartlamp_group_round(lamps, values, n, SL_CMD_PREP_LED, todo, ok);
+    if (ret) {
+        smartlamp_group_round(lamps, NULL, n, SL_CMD_ABORT_LED, todo, ok);
+        goto out;
+    }
+    ret = smartlamp_group_round(lamps, NULL, n, SL_CMD_COMMIT_LED, todo, applied);
+    if (ret) {
+        for (i = 0; i < n; i++) todo[i] = !applied[i];
+        smartlamp_group_round(lamps, NULL, n, SL_CMD_ABORT_LED, todo, ok);
+    }
+
+out:
+    for (i = locked - 1; i >= 0; i--) {
+        smartlamp_end(lamps[i]);
+    }
+    mutex_unlock(&smartlamp_group_mutex);
+    kfree(todo);
+
+    for (i = 0; i < n; i++) {
+        if (applied[i]) smartlamp_genl_led(lamps[i], values[i]);
+    }
     return ret;
 }
 
+// --- Recuperacao de falhas ---
+
+// Comeca a recuperacao da lampada, pode ser chamada do callback do URB.
+// Quem esta esperando resposta ou a vez no escalonador eh acordado e recebe -ETIMEDOUT.
+static void smartlamp_recover(struct smartlamp *lamp) {
+    unsigned long flags;
+    bool start;
+
+    spin_lock_irqsave(&lamp->rx_lock, flags);
+    start = !lamp->recovering;
+    lamp->recovering = true;
+    spin_unlock_irqrestore(&lamp->rx_lock, flags);
+
+    if (start) {
+        wake_up(&lamp->response_wait);
+        wake_up_all(&lamp->sched_wait);
+        schedule_delayed_work(&lamp->recover_work, 0);
+    }
+}
+
+// Confere se o firmware voltou a responder e ressincroniza o protocolo.
+// O '\n' no inicio termina uma linha que tenha ficado pela metade no firmware; a resposta
+// dessa linha (um "ERR"), se houver, eh descartada. O GET_TIME de teste tambem atualiza o
+// relogio, e os avisos e lotes configurados sao enviados de novo caso o firmware tenha reiniciado.
+// Deve ser chamada com io_mutex travado e a leitura rodando.
+static int smartlamp_resync(struct smartlamp *lamp) {
+    char command[MAX_RECV_LINE];
+    struct sl_msg response;
+    size_t len;
+    int sensor, tries, ret;
+    struct smartlamp_event_config *config;
+
+    // a UART nao foi configurada (smartlamp_rx_start falhou), nada do que o firmware responder chega
+    if (!lamp->rx_running) return -EIO;
+
+    command[0] = '\n';
+    len = 1 + sl_encode_cmd(command + 1, SL_CMD_GET_TIME);
+    ret = smartlamp_write(lamp, command);
+    for (tries = 0; ret == 0 && tries < 2; tries++) {
+        ret = smartlamp_wait_response(lamp, SL_CMD_GET_TIME, &response, RECOVERY_PROBE_TIMEOUT_MS, false);
+        if (ret == 0 && response.kind == SL_MSG_RES) break;
+        if (ret == 0) ret = -EPROTO;
+    }
+    if (ret) return ret;
+    smartlamp_clock_apply(lamp, &response, len);
+
+    for (sensor = 0; sensor < SL_SENSOR_COUNT; sensor++) {
+        config = &lamp->event_config[sensor];
+        if (!config->delta && !config->threshold_enabled) continue;
+        sl_encode_set_evt(command, sensor, config->delta, config->threshold_enabled, config->threshold, config->hyst);
+        ret = smartlamp_write(lamp, command);
+        if (ret == 0) ret = smartlamp_wait_response(lamp, SL_CMD_SET_EVT, &response, RECOVERY_PROBE_TIMEOUT_MS, false);
+        if (ret) return ret;
+    }
+
+    if (lamp->batch_period_ms) {
+        sl_encode_set_batch(command, lamp->batch_period_ms, lamp->batch_records);
+        ret = smartlamp_write(lamp, command);
+        if (ret == 0) ret = smartlamp_wait_response(lamp, SL_CMD_SET_BATCH, &response, RECOVERY_PROBE_TIMEOUT_MS, false);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+// Recuperacao em dois passos:
+//  1. para a leitura, limpa o halt dos dois endpoints bulk e ressincroniza
+//  2. se o firmware ainda nao responder, reseta o dispositivo (usb_reset_device).
+//     O driver tem pre_reset/post_reset, entao a lampada continua a mesma (lampN,
+//     sysfs, configuracao de avisos) e nao passa por desconexao e novo probe.
+// Se os dois passos falharem, tenta de novo mais tarde; enquanto isso os comandos
+// continuam falhando na hora.
+static void smartlamp_recover_work(struct work_struct *work) {
+    struct smartlamp *lamp = container_of(to_delayed_work(work), struct smartlamp, recover_work);
+    struct usb_device *udev;
+    int ret;
+
+    mutex_lock(&lamp->io_mutex);
+    udev = lamp->udev;
+    if (!udev) {
+        // desconectada, os comandos ja recebem -ENODEV
+        mutex_unlock(&lamp->io_mutex);
+        return;
+    }
+    printk(KERN_WARNING "SmartLamp: lamp%d nao responde, limpando os endpoints\n", lamp->id);
+    if (!lamp->recover_delay_ms) smartlamp_genl_state(lamp, SMARTLAMP_STATE_RECOVERING); // so na primeira tentativa
+
+    usb_kill_urb(lamp->in_urb);
+    usb_clear_halt(udev, usb_rcvbulkpipe(udev, lamp->usb_in));
+    usb_clear_halt(udev, usb_sndbulkpipe(udev, lamp->usb_out));
+    ret = smartlamp_rx_start(lamp);
+    if (ret == 0) ret = smartlamp_resync(lamp);
+    mutex_unlock(&lamp->io_mutex);
+
+    if (ret) {
+        // o udev continua valido: o usb_disconnect espera esta work terminar
+        printk(KERN_WARNING "SmartLamp: lamp%d ainda nao responde, resetando o dispositivo\n", lamp->id);
+        ret = usb_lock_device_for_reset(udev, lamp->interface);
+        if (ret == 0) {
+            ret = usb_reset_device(udev); // chama usb_pre_reset e usb_post_reset
+            usb_unlock_device(udev);
+        }
+        if (ret == 0) {
+            mutex_lock(&lamp->io_mutex);
+            ret = lamp->udev ? smartlamp_resync(lamp) : -ENODEV;
+            mutex_unlock(&lamp->io_mutex);
+        }
+    }
+
+    if (ret == 0) {
+        printk(KERN_INFO "SmartLamp: lamp%d recuperada\n", lamp->id);
+        lamp->recover_delay_ms = 0;
+        spin_lock_irq(&lamp->rx_lock);
+        lamp->recovering = false;
+        spin_unlock_irq(&lamp->rx_lock);
+        smartlamp_genl_state(lamp, SMARTLAMP_STATE_ONLINE);
+        return;
+    }
+
+    lamp->recover_delay_ms = clamp_t(unsigned int, lamp->recover_delay_ms * 2, RECOVERY_RETRY_MIN_MS, RECOVERY_RETRY_MAX_MS);
+    printk(KERN_ERR "SmartLamp: Falha ao recuperar lamp%d. Erro: %d, nova tentativa em %u ms\n",
+           lamp->id, ret, lamp->recover_delay_ms);
+    schedule_delayed_work(&lamp->recover_work, msecs_to_jiffies(lamp->recover_delay_ms));
+}
+
+// Executado pelo USB core antes de resetar o dispositivo, seja pela recuperacao ou por
+// outro motivo: espera a transacao em andamento e para a leitura. O io_mutex fica travado
+// ate o usb_post_reset.
+static int usb_pre_reset(struct usb_interface *interface) {
+    struct smartlamp *lamp = usb_get_intfdata(interface);
+
+    mutex_lock(&lamp->io_mutex);
+    usb_kill_urb(lamp->in_urb);
+    return 0;
+}
+
+// Executado depois do reset: o CP210x volta a configuracao padrao, entao a UART
+// eh configurada de novo (pelo smartlamp_rx_start) e a leitura recomeca.
+// Se a configuracao falhar a lampada entra (ou continua) em recuperacao, que tenta de novo.
+static int usb_post_reset(struct usb_interface *interface) {
+    struct smartlamp *lamp = usb_get_intfdata(interface);
+    int ret;
+
+    if (lamp->udev) {
+        ret = smartlamp_rx_start(lamp);
+        if (ret) {
+            printk(KERN_ERR "SmartLamp: lamp%d nao voltou do reset. Erro: %d\n", lamp->id, ret);
+            smartlamp_recover(lamp);
+        }
+    }
+    mutex_unlock(&lamp->io_mutex);
+    return 0;
+}
+
+// Leituras periodicas pedidas no arquivo poll. Elas tem a menor prioridade e o prazo de
+// um periodo: se os comandos do usuario ocuparem a lampada ate a proxima leitura, a
+// leitura atrasada eh descartada em vez de se acumular na fila.
+static void smartlamp_poll_work(struct work_struct *work) {
+    struct smartlamp *lamp = container_of(to_delayed_work(work), struct smartlamp, poll_work);
+    struct smartlamp_sample sample;
+    unsigned int period_ms;
+    u64 deadline_ns;
+    int sensor;
+
+    spin_lock(&lamp->poll_lock);
+    period_ms = lamp->disconnected ? 0 : lamp->poll_ms;
+    spin_unlock(&lamp->poll_lock);
+    if (!period_ms) return;
+    deadline_ns = ktime_get_ns() + (u64)period_ms * NSEC_PER_MSEC;
+    for (sensor = 0; sensor < SL_SENSOR_COUNT; sensor++) {
+        if (smartlamp_read_sensor(lamp, sensor, SMARTLAMP_PRIO_BACKGROUND, deadline_ns, &sample) == 0) {
+            smartlamp_notify_sensor(lamp, sensor);
+        }
+    }
+
+    // o periodo pode ter mudado durante as leituras
+    spin_lock(&lamp->poll_lock);
+    if (!lamp->disconnected && lamp->poll_ms) {
+        schedule_delayed_work(&lamp->poll_work, msecs_to_jiffies(lamp->poll_ms));
+    }
+    spin_unlock(&lamp->poll_lock);
+}
+
+// Impede novos agendamentos da poll_work e espera a que estiver rodando
+static void smartlamp_poll_stop(struct smartlamp *lamp) {
+    spin_lock(&lamp->poll_lock);
+    lamp->disconnected = true;
+    spin_unlock(&lamp->poll_lock);
+    cancel_delayed_work_sync(&lamp->poll_work);
+}
+
 // Executado quando o dispositivo é conectado na USB
 // e faz toda a config inicial
 static int usb_probe(struct usb_interface *interface, const struct usb_device_id *id) {
     struct usb_endpoint_descriptor *usb_endpoint_in, *usb_endpoint_out;
+    struct smartlamp *lamp, *pos;
+    struct smartlamp_sample sample;
+    char name[16];
+    int i, ret;
     printk(KERN_INFO "SmartLamp: Dispositivo conectado ...\n");
 
-    smartlamp_device = interface_to_usbdev(interface);
+    lamp = kzalloc(sizeof(*lamp), GFP_KERNEL);
+    if (!lamp) return -ENOMEM;
+    kref_init(&lamp->kref);
+    mutex_init(&lamp->io_mutex);
+    spin_lock_init(&lamp->sample_lock);
+    spin_lock_init(&lamp->rx_lock);
+    init_waitqueue_head(&lamp->response_wait);
+    init_completion(&lamp->out_done);
+    INIT_WORK(&lamp->event_work, smartlamp_event_work);
+    INIT_DELAYED_WORK(&lamp->recover_work, smartlamp_recover_work);
+    spin_lock_init(&lamp->sched_lock);
+    for (i = 0; i < SMARTLAMP_PRIO_COUNT; i++) INIT_LIST_HEAD(&lamp->sched_queue[i]);
+    init_waitqueue_head(&lamp->sched_wait);
+    spin_lock_init(&lamp->poll_lock);
+    INIT_DELAYED_WORK(&lamp->poll_work, smartlamp_poll_work);
+    INIT_LIST_HEAD(&lamp->node);
+    lamp->udev = interface_to_usbdev(interface);
+    lamp->interface = interface;
 
     // Encontra os endpoints e aloca os buffers
     if (usb_find_common_endpoints(interface->cur_altsetting, &usb_endpoint_in, &usb_endpoint_out, NULL, NULL)) {
-        printk(KERN_ERR "SmartLamp: Endpoints nao encontrados\n"); return -EIO;
+        printk(KERN_ERR "SmartLamp: Endpoints nao encontrados\n");
+        ret = -EIO;
+        goto err_put;
     }
-    usb_max_size = usb_endpoint_maxp(usb_endpoint_in);
-    usb_in = usb_endpoint_in->bEndpointAddress;
-    usb_out = usb_endpoint_out->bEndpointAddress;
+    lamp->usb_max_size = usb_endpoint_maxp(usb_endpoint_in);
+    lamp->usb_in = usb_endpoint_in->bEndpointAddress;
+    lamp->usb_out = usb_endpoint_out->bEndpointAddress;
     // aloca a memoria para os buffers
-    usb_in_buffer = kmalloc(usb_max_size, GFP_KERNEL);
-    usb_out_buffer = kmalloc(usb_max_size, GFP_KERNEL);
+    lamp->usb_in_buffer = kmalloc(lamp->usb_max_size, GFP_KERNEL);
+    lamp->usb_out_buffer = kmalloc(lamp->usb_max_size, GFP_KERNEL);
+    lamp->in_urb = usb_alloc_urb(0, GFP_KERNEL);
+    lamp->out_urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!lamp->usb_in_buffer || !lamp->usb_out_buffer || !lamp->in_urb || !lamp->out_urb) {
+        ret = -ENOMEM;
+        goto err_put;
+    }
+
+    lamp->id = ida_alloc(&smartlamp_ida, GFP_KERNEL);
+    if (lamp->id < 0) {
+        ret = lamp->id;
+        goto err_put;
+    }
+
+    // Cria a interface sysfs da lampada
+    // antes de comecar a leitura, para que os avisos do firmware ja tenham onde chegar
+    snprintf(name, sizeof(name), "lamp%d", lamp->id);
+    lamp->kobj = kobject_create_and_add(name, smartlamp_kobj);
+    if (!lamp->kobj) {
+        ret = -ENOMEM;
+        goto err_ida;
+    }
+
+    if (sysfs_create_group(lamp->kobj, &lamp_attr_group)) {
+        ret = -ENOMEM;
+        goto err_kobj;
+    }
+
+    usb_set_intfdata(interface, lamp); // usado pelo usb_pre_reset/usb_post_reset
+    ret = smartlamp_rx_start(lamp);
+    if (ret) goto err_kobj;
 
     // Inicia a comunicação enviando o comando
     msleep(200);
     // ALTERAÇÃO TAREFA 5: Usa a função de transação para ler o LDR
-    if (smartlamp_transaction("GET_LDR\n", usb_in_buffer) == 0) {
-        sscanf(usb_in_buffer, "RES GET_LDR %d", &LDR_value);
-        printk(KERN_INFO "SmartLamp: SUCESSO! Valor do LDR lido: %d\n", LDR_value);
+    // a primeira leitura tambem faz a primeira sincronizacao do relogio
+    if (smartlamp_read_sensor(lamp, SL_SENSOR_LDR, SMARTLAMP_PRIO_ONDEMAND, 0, &sample) == 0) {
+        printk(KERN_INFO "SmartLamp: SUCESSO! Valor do LDR lido: %d\n", sample.value);
     } else {
         printk(KERN_WARNING "SmartLamp: Nao foi possivel ler o valor do LDR.\n");
-        LDR_value = -1;
     }
 
-    // Cria a interface sysfs
-    smartlamp_kobj = kobject_create_and_add("smartlamp", kernel_kobj);
-    if (!smartlamp_kobj) {
-        return -ENOMEM;
+    // mantem a lista ordenada pelo id, a atualizacao em grupo depende disso
+    // para travar as lampadas sempre na mesma ordem
+    mutex_lock(&smartlamp_list_mutex);
+    list_for_each_entry(pos, &smartlamp_list, node) {
+        if (pos->id > lamp->id) break;
     }
+    list_add_tail(&lamp->node, &pos->node);
+    mutex_unlock(&smartlamp_list_mutex);
 
-    if (sysfs_create_group(smartlamp_kobj, &attr_group)) {
-        kobject_put(smartlamp_kobj);
-        return -ENOMEM;
-    }
-    printk(KERN_INFO "SmartLamp: Interface sysfs criada em /sys/kernel/smartlamp\n");
+    printk(KERN_INFO "SmartLamp: Interface sysfs criada em /sys/kernel/smartlamp/lamp%d\n", lamp->id);
+    smartlamp_genl_state(lamp, SMARTLAMP_STATE_ONLINE);
 
     return 0;
+
+err_kobj:
+    mutex_lock(&lamp->io_mutex);
+    lamp->udev = NULL;
+    mutex_unlock(&lamp->io_mutex);
+    usb_kill_urb(lamp->in_urb);
+    cancel_delayed_work_sync(&lamp->recover_work);
+    smartlamp_poll_stop(lamp);
+    cancel_work_sync(&lamp->event_work);
+    usb_set_intfdata(interface, NULL);
+    kobject_put(lamp->kobj);
+err_ida:
+    ida_free(&smartlamp_ida, lamp->id);
+err_put:
+    smartlamp_put(lamp);
+    return ret;
 }
 
 // Executado quando o dispositivo USB é desconectado da USB
 static void usb_disconnect(struct usb_interface *interface) {
+    struct smartlamp *lamp = usb_get_intfdata(interface);
+
+    mutex_lock(&smartlamp_list_mutex);
+    list_del(&lamp->node);
+    mutex_unlock(&smartlamp_list_mutex);
+
+    // espera a transacao em andamento terminar antes de soltar o dispositivo,
+    // depois disso nenhum comando eh enviado e a recuperacao nao faz mais nada
+    mutex_lock(&lamp->io_mutex);
+    lamp->udev = NULL; // segurança e prevenção de crashes, limpa o ponteiro
+    mutex_unlock(&lamp->io_mutex);
+
+    // para a leitura, a recuperacao, as leituras periodicas e os avisos pendentes antes de remover o sysfs
+    usb_kill_urb(lamp->in_urb);
+    cancel_delayed_work_sync(&lamp->recover_work);
+    smartlamp_poll_stop(lamp);
+    cancel_work_sync(&lamp->event_work);
+
     // remove os arquivos e dir
-    kobject_put(smartlamp_kobj); //  remover a interface sysfs
-    printk(KERN_INFO "SmartLamp: Dispositivo desconectado.\n");
-    //libera a memoria dos buffers
-    kfree(usb_in_buffer);
-    kfree(usb_out_buffer);
-    smartlamp_device = NULL; // segurança e prevenção de crashes, limpa o ponteiro
+    kobject_put(lamp->kobj); //  remover a interface sysfs
+    usb_set_intfdata(interface, NULL);
+
+    // avisa antes de liberar o id, que pode ser reaproveitado pela proxima lampada
+    smartlamp_genl_state(lamp, SMARTLAMP_STATE_OFFLINE);
+    ida_free(&smartlamp_ida, lamp->id);
+    printk(KERN_INFO "SmartLamp: Dispositivo lamp%d desconectado.\n", lamp->id);
+    smartlamp_put(lamp);
 }
 
 // --- Funcao do Sysfs adicionadas ---
@@ -187,85 +1575,592 @@ static void usb_disconnect(struct usb_interface *interface) {
 // show = leitura, todas as funcoes de leitura do sysfs sao chamadas na funcao principal
 // formata a leitura para o usuario
 static ssize_t led_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct smartlamp *lamp = smartlamp_get_by_kobj(kobj);
     int value = -1;
-    if (!smartlamp_device) return -ENODEV;
+    if (!lamp) return -ENODEV;
 
-    // TAREFA 5: Simplificado para usar a função de transação
-    if (smartlamp_transaction("GET_LED\n", usb_in_buffer) == 0) {
-        sscanf(usb_in_buffer, "RES GET_LED %d", &value);
+    if (smartlamp_get_led(lamp, 0, &value) == 0) {
         printk(KERN_INFO "SmartLamp: Lendo valor do LED: %d\n", value);
     }
+    smartlamp_put(lamp);
     return sprintf(buf, "%d\n", value);
 }
 
 // Função chamada quando algo é escrito no arquivo /sys/kernel/smartlamp/led
 // funcao de escrita
 static ssize_t led_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
-    int new_value; // A variável 'ret' não é mais necessária aqui
-    char command[32];
+    struct smartlamp *lamp;
+    int new_value;
+    int ret;
 
-    if (!smartlamp_device) return -ENODEV;
     // converte o texto do usuario para um numero
     if (kstrtoint(buf, 10, &new_value) != 0) return -EINVAL;
 
+    lamp = smartlamp_get_by_kobj(kobj);
+    if (!lamp) return -ENODEV;
+
     printk(KERN_INFO "SmartLamp: Alterando valor do LED para %d\n", new_value);
+    ret = smartlamp_set_led(lamp, new_value, 0);
+    smartlamp_put(lamp);
+    return ret ? ret : count;
+}
 
-    // O bloco de usb_control_msg e usb_bulk_msg foi substituido 
-    // pela chamada de funcao principal unificada
+// Copia a ultima amostra do sensor se ela foi avisada ao poll() ha menos de
+// NOTIFY_FRESH_NS (aviso do firmware, lote ou leitura periodica). Falso se nao houve aviso recente.
+static bool smartlamp_notified_sample(struct smartlamp *lamp, int sensor, struct smartlamp_sample *sample) {
+    bool fresh;
 
-    // Monta o comando a ser enviado
-    snprintf(command, sizeof(command), "SET_LED %d\n", new_value);
-    
-    // Envia o comando e recebe a resposta usando a função unificada
-    if (smartlamp_transaction(command, usb_in_buffer) < 0) {
-        // Se a comunicação falhar, retorna um erro de I/O (Input/Output)
-        return -EIO;
+    spin_lock(&lamp->sample_lock);
+    *sample = lamp->samples[sensor];
+    fresh = sample->valid && lamp->notify_ns[sensor] &&
+            ktime_get_ns() - lamp->notify_ns[sensor] < NOTIFY_FRESH_NS;
+    spin_unlock(&lamp->sample_lock);
+    return fresh;
+}
+
+// Função chamada quando o arquivo de um sensor (/sys/kernel/smartlamp/ldr, temp, hum, ...) é lido
+// le o sensor e formata o valor para o usuario, -1 em caso de falha.
+// Logo depois de um aviso ao poll() devolve a amostra avisada sem acessar a USB.
+static ssize_t sensor_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct smartlamp *lamp = smartlamp_get_by_kobj(kobj);
+    struct smartlamp_sample sample;
+    int sensor = attr - sensor_attributes;
+    int len;
+
+    if (!lamp) return -ENODEV;
+
+    if (smartlamp_notified_sample(lamp, sensor, &sample) ||
+        smartlamp_read_sensor(lamp, sensor, SMARTLAMP_PRIO_ONDEMAND, 0, &sample) == 0) {
+        len = sl_put_fixed(buf, sample.value, sl_sensors[sensor].scale);
+    } else {
+        len = sprintf(buf, "-1");
     }
+    smartlamp_put(lamp);
+    buf[len++] = '\n';
+    buf[len] = '\0';
+    printk(KERN_INFO "SmartLamp: Lendo valor do sensor %s: %s", sl_sensors[sensor].name, buf);
+    return len;
+}
 
-    return count;
+// Função chamada quando o arquivo /sys/kernel/smartlamp/samples é lido
+// mostra a ultima amostra de cada sensor sem acessar a USB, uma por linha:
+// "<sensor> <valor> <horario em ns no CLOCK_MONOTONIC do host>"
+static ssize_t samples_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct smartlamp *lamp = smartlamp_get_by_kobj(kobj);
+    struct smartlamp_sample samples[SL_SENSOR_COUNT];
+    int sensor, len = 0;
+
+    if (!lamp) return -ENODEV;
+
+    spin_lock(&lamp->sample_lock);
+    memcpy(samples, lamp->samples, sizeof(samples));
+    spin_unlock(&lamp->sample_lock);
+    smartlamp_put(lamp);
+
+    for (sensor = 0; sensor < SL_SENSOR_COUNT; sensor++) {
+        if (!samples[sensor].valid) continue;
+        len += sprintf(buf + len, "%s ", sl_sensors[sensor].name);
+        len += sl_put_fixed(buf + len, samples[sensor].value, sl_sensors[sensor].scale);
+        len += sprintf(buf + len, " %llu\n", samples[sensor].host_ns);
+    }
+    return len;
+}
+
+// Função chamada quando o arquivo /sys/kernel/smartlamp/group é lido
+// mostra as lampadas que nao confirmaram o novo valor na ultima atualizacao em grupo,
+// separadas por espaco (linha vazia se todas confirmaram)
+static ssize_t group_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    int i, len = 0;
+
+    mutex_lock(&smartlamp_group_mutex);
+    for (i = 0; i < smartlamp_group_failed_count; i++) {
+        len += sprintf(buf + len, i ? " %d" : "%d", smartlamp_group_failed[i]);
+    }
+    mutex_unlock(&smartlamp_group_mutex);
+    len += sprintf(buf + len, "\n");
+    return len;
 }
 
-// TAREFA 5: Implementação da função para ler a temperatura
-static ssize_t temp_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
-    char *value_str = "-1";
-    char *response_prefix = "RES GET_TEMP ";
+// Função chamada quando algo é escrito no arquivo /sys/kernel/smartlamp/group
+// recebe pares "lampada=brilho" (brilho de 0 a 100) separados por espaco, ex: "0=75 1=30 2=100",
+// e aplica todos os valores juntos com PREP_LED/COMMIT_LED.
+// Se a escrita falhar com EIO, a leitura do arquivo diz quais lampadas nao mudaram.
+static ssize_t group_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
+    struct smartlamp **lamps, *lamp;
+    int *ids, *values;
+    bool *applied;
+    char *text, *cursor, *token, *value_str;
+    int n = 0, got = 0, failed, i, j;
+    ssize_t ret;
 
-    if (!smartlamp_device) return -ENODEV;
+    lamps = kcalloc(MAX_GROUP_LAMPS, sizeof(*lamps), GFP_KERNEL);
+    ids = kcalloc(MAX_GROUP_LAMPS, sizeof(*ids), GFP_KERNEL);
+    values = kcalloc(MAX_GROUP_LAMPS, sizeof(*values), GFP_KERNEL);
+    applied = kcalloc(MAX_GROUP_LAMPS, sizeof(*applied), GFP_KERNEL);
+    text = kstrndup(buf, count, GFP_KERNEL);
+    if (!lamps || !ids || !values || !applied || !text) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    // separa os pares "id=valor"
+    cursor = text;
+    while ((token = strsep(&cursor, " \t\n,")) != NULL) {
+        if (!*token) continue;
+        value_str = strchr(token, '=');
+        if (!value_str || n == MAX_GROUP_LAMPS) { ret = -EINVAL; goto out; }
+        *value_str++ = '\0';
+        if (kstrtoint(token, 10, &ids[n]) || kstrtoint(value_str, 10, &values[n])) { ret = -EINVAL; goto out; }
+        if (values[n] < 0 || values[n] > 100) { ret = -EINVAL; goto out; } // brilho fora de 0..100, nada eh enviado
+        for (j = 0; j < n; j++) {
+            if (ids[j] == ids[n]) { ret = -EINVAL; goto out; } // lampada repetida
+        }
+        n++;
+    }
+    if (n == 0) { ret = -EINVAL; goto out; }
 
-    if (smartlamp_transaction("GET_TEMP\n", usb_in_buffer) == 0) {
-        // Encontra o início do valor (após o prefixo) e o copia para o buffer de saída
-        if (strstr(usb_in_buffer, response_prefix)) {
-            value_str = usb_in_buffer + strlen(response_prefix);
+    // pega as lampadas na ordem da lista (ordem crescente de id), reordenando os valores junto
+    mutex_lock(&smartlamp_list_mutex);
+    list_for_each_entry(lamp, &smartlamp_list, node) {
+        for (i = 0; i < n; i++) {
+            if (ids[i] != lamp->id) continue;
+            kref_get(&lamp->kref);
+            lamps[got] = lamp;
+            swap(ids[i], ids[got]);
+            swap(values[i], values[got]);
+            got++;
+            break;
         }
     }
-    printk(KERN_INFO "SmartLamp: Lendo valor da Temperatura: %s\n", value_str);
-    return sprintf(buf, "%s", value_str); // Retorna o valor como string, incluindo o \n já vindo do dispositivo
+    mutex_unlock(&smartlamp_list_mutex);
+
+    if (got != n) {
+        ret = -ENODEV; // alguma lampada pedida nao esta conectada
+    } else {
+        printk(KERN_INFO "SmartLamp: Alterando o LED de %d lampadas em grupo\n", n);
+        ret = smartlamp_group_set(lamps, values, n, applied);
+
+        mutex_lock(&smartlamp_group_mutex);
+        failed = 0;
+        for (i = 0; i < n; i++) {
+            if (!applied[i]) smartlamp_group_failed[failed++] = ids[i];
+        }
+        smartlamp_group_failed_count = failed;
+        mutex_unlock(&smartlamp_group_mutex);
+
+        if (ret == 0) ret = count;
+        else if (ret != -ETIMEDOUT && ret != -ENOMEM) ret = -EIO; // -ETIMEDOUT: alguma lampada em recuperacao
+        if (failed && failed < n) {
+            printk(KERN_ERR "SmartLamp: atualizacao em grupo parcial, %d de %d lampadas nao mudaram\n", failed, n);
+        }
+    }
+
+    for (i = 0; i < got; i++) {
+        smartlamp_put(lamps[i]);
+    }
+
+out:
+    kfree(text);
+    kfree(applied);
+    kfree(values);
+    kfree(ids);
+    kfree(lamps);
+    return ret;
 }
 
-// TAREFA 5: Implementação da função para ler a umidade
-static ssize_t hum_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
-    char *value_str = "-1";
-    char *response_prefix = "RES GET_HUM ";
+// Função chamada quando o arquivo /sys/kernel/smartlamp/events é lido
+// mostra a configuracao de avisos de cada sensor: "<sensor> <delta> [<threshold> <hyst>]"
+static ssize_t events_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct smartlamp *lamp = smartlamp_get_by_kobj(kobj);
+    struct smartlamp_event_config *config;
+    int sensor, scale, len = 0;
 
-    if (!smartlamp_device) return -ENODEV;
+    if (!lamp) return -ENODEV;
 
-    if (smartlamp_transaction("GET_HUM\n", usb_in_buffer) == 0) {
-        if (strstr(usb_in_buffer, response_prefix)) {
-            value_str = usb_in_buffer + strlen(response_prefix);
+    mutex_lock(&lamp->io_mutex);
+    for (sensor = 0; sensor < SL_SENSOR_COUNT; sensor++) {
+        config = &lamp->event_config[sensor];
+        scale = sl_sensors[sensor].scale;
+        len += sprintf(buf + len, "%s ", sl_sensors[sensor].name);
+        len += sl_put_fixed(buf + len, config->delta, scale);
+        if (config->threshold_enabled) {
+            buf[len++] = ' ';
+            len += sl_put_fixed(buf + len, config->threshold, scale);
+            buf[len++] = ' ';
+            len += sl_put_fixed(buf + len, config->hyst, scale);
         }
+        buf[len++] = '\n';
     }
-    printk(KERN_INFO "SmartLamp: Lendo valor da Umidade: %s\n", value_str);
-    return sprintf(buf, "%s", value_str);
+    mutex_unlock(&lamp->io_mutex);
+    smartlamp_put(lamp);
+    return len;
 }
 
-// TAREFA 5: Implementação da função para ler o ldr
-static ssize_t ldr_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
-    int value = -1;
-    if (!smartlamp_device) return -ENODEV;
+// Função chamada quando algo é escrito no arquivo /sys/kernel/smartlamp/events
+// recebe "<sensor> <delta>" ou "<sensor> <delta> <threshold> <hyst>" e envia SET_EVT ao firmware
+static ssize_t events_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
+    struct smartlamp *lamp;
+    struct smartlamp_event_config config = {};
+    const char *p = buf, *end = buf + count, *token;
+    char command[MAX_RECV_LINE];
+    struct sl_msg response;
+    int32_t values[3];
+    size_t token_len;
+    int sensor, n;
+    ssize_t ret;
 
-    if (smartlamp_transaction("GET_LDR\n", usb_in_buffer) == 0) {
-        sscanf(usb_in_buffer, "RES GET_LDR %d", &value);
-        printk(KERN_INFO "SmartLamp: Lendo valor do LDR: %d\n", value);
+    while (end > p && (end[-1] == '\n' || end[-1] == ' ')) end--;
+
+    token_len = sl_token(&p, end, &token);
+    for (sensor = 0; sensor < SL_SENSOR_COUNT; sensor++) {
+        if (strlen(sl_sensors[sensor].name) == token_len && !memcmp(sl_sensors[sensor].name, token, token_len)) break;
     }
-    return sprintf(buf, "%d\n", value);
-}
\ No newline at end of file
+    if (sensor == SL_SENSOR_COUNT) return -EINVAL;
+
+    for (n = 0; n < 3; n++) {
+        sl_skip_spaces(&p, end);
+        if (p == end) break;
+        if (sl_parse_fixed(&p, end, sl_sensors[sensor].scale, &values[n]) || (p < end && *p != ' ')) return -EINVAL;
+    }
+    sl_skip_spaces(&p, end);
+    if (p != end || (n != 1 && n != 3)) return -EINVAL;
+
+    config.delta = values[0];
+    if (n == 3) {
+        config.threshold_enabled = true;
+        config.threshold = values[1];
+        config.hyst = values[2];
+    }
+    if (config.delta < 0 || config.hyst < 0) return -EINVAL;
+
+    sl_encode_set_evt(command, sensor, config.delta, config.threshold_enabled, config.threshold, config.hyst);
+
+    lamp = smartlamp_get_by_kobj(kobj);
+    if (!lamp) return -ENODEV;
+
+    ret = smartlamp_begin(lamp, SMARTLAMP_PRIO_INTERACTIVE, 0);
+    if (ret) {
+        smartlamp_put(lamp);
+        return ret;
+    }
+    if (smartlamp_transaction_locked(lamp, SL_CMD_SET_EVT, command, &response) < 0 || response.value != 1) {
+        ret = -EIO;
+    } else {
+        lamp->event_config[sensor] = config;
+        ret = count;
+    }
+    smartlamp_end(lamp);
+    smartlamp_put(lamp);
+    return ret;
+}
+
+// Função chamada quando o arquivo /sys/kernel/smartlamp/poll é lido
+// mostra o intervalo das leituras periodicas em ms, 0 = desligadas
+static ssize_t poll_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct smartlamp *lamp = smartlamp_get_by_kobj(kobj);
+    unsigned int period_ms;
+    ssize_t len;
+
+    if (!lamp) return -ENODEV;
+    spin_lock(&lamp->poll_lock);
+    period_ms = lamp->poll_ms;
+    spin_unlock(&lamp->poll_lock);
+    len = sprintf(buf, "%u\n", period_ms);
+    smartlamp_put(lamp);
+    return len;
+}
+
+// Função chamada quando algo é escrito no arquivo /sys/kernel/smartlamp/poll
+// liga as leituras periodicas de todos os sensores a cada <ms>, ou desliga com 0.
+// Cada leitura acorda quem esta em poll()/select() nos arquivos do sensor e no samples.
+static ssize_t poll_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
+    struct smartlamp *lamp;
+    unsigned int period_ms;
+
+    if (kstrtouint(buf, 10, &period_ms) != 0) return -EINVAL;
+    if (period_ms && period_ms < POLL_MIN_MS) return -EINVAL;
+
+    lamp = smartlamp_get_by_kobj(kobj);
+    if (!lamp) return -ENODEV;
+
+    spin_lock(&lamp->poll_lock);
+    if (lamp->disconnected) {
+        spin_unlock(&lamp->poll_lock);
+        smartlamp_put(lamp);
+        return -ENODEV;
+    }
+    lamp->poll_ms = period_ms;
+    if (period_ms) mod_delayed_work(system_wq, &lamp->poll_work, 0);
+    spin_unlock(&lamp->poll_lock);
+    smartlamp_put(lamp);
+    return count;
+}
+
+// Função chamada quando o arquivo /sys/kernel/smartlamp/batch é lido
+// mostra "<periodo em ms> <registros por lote>", "0 0" = desligado
+static ssize_t batch_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+    struct smartlamp *lamp = smartlamp_get_by_kobj(kobj);
+    ssize_t len;
+
+    if (!lamp) return -ENODEV;
+    mutex_lock(&lamp->io_mutex);
+    len = sprintf(buf, "%u %u\n", lamp->batch_period_ms, lamp->batch_records);
+    mutex_unlock(&lamp->io_mutex);
+    smartlamp_put(lamp);
+    return len;
+}
+
+// Função chamada quando algo é escrito no arquivo /sys/kernel/smartlamp/batch
+// "<periodo em ms> [<registros>]": o firmware le todos os sensores a cada periodo e envia
+// as leituras em lotes compactados (SET_BATCH), bem mais amostras pela mesma serial do que
+// com GET_<SENSOR> ou EVT. Cada amostra chega aos inscritos no netlink e a mais recente de
+// cada sensor fica em samples. "0" desliga.
+static ssize_t batch_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
+    struct smartlamp *lamp;
+    const char *p = buf, *end = buf + count;
+    char command[MAX_RECV_LINE];
+    struct sl_msg response;
+    uint64_t period_ms, records = SL_BATCH_MAX_RECORDS;
+    ssize_t ret;
+
+    while (end > p && (end[-1] == '\n' || end[-1] == ' ')) end--;
+
+    sl_skip_spaces(&p, end);
+    if (sl_parse_u64(&p, end, &period_ms)) return -EINVAL;
+    sl_skip_spaces(&p, end);
+    if (p < end && sl_parse_u64(&p, end, &records)) return -EINVAL;
+    if (p != end) return -EINVAL;
+    if (period_ms == 0) {
+        records = 0;
+    } else if (period_ms < SL_BATCH_MIN_PERIOD_MS || period_ms > SL_BATCH_MAX_PERIOD_MS ||
+               records < 1 || records > SL_BATCH_MAX_RECORDS) {
+        return -EINVAL;
+    }
+
+    sl_encode_set_batch(command, period_ms, records);
+
+    lamp = smartlamp_get_by_kobj(kobj);
+    if (!lamp) return -ENODEV;
+
+    ret = smartlamp_begin(lamp, SMARTLAMP_PRIO_INTERACTIVE, 0);
+    if (ret) {
+        smartlamp_put(lamp);
+        return ret;
+    }
+    // os horarios do lote sao convertidos com o relogio sincronizado
+    if (period_ms && !lamp->clock.valid) smartlamp_clock_sync(lamp);
+    if (smartlamp_transaction_locked(lamp, SL_CMD_SET_BATCH, command, &response) < 0 || response.value != 1) {
+        ret = -EIO;
+    } else {
+        lamp->batch_period_ms = period_ms;
+        lamp->batch_records = records;
+        ret = count;
+    }
+    smartlamp_end(lamp);
+    smartlamp_put(lamp);
+    return ret;
+}
+
+// --- Canal Generic Netlink ---
+// Amostras e mudancas de estado vao para o grupo "events", os programas inscritos recebem
+// tudo sem ler o sysfs. Todas as funcoes rodam em contexto de processo (podem dormir).
+
+#define SMARTLAMP_GENL_MSG_SIZE (5 * nla_total_size(sizeof(u32)) + nla_total_size_64bit(sizeof(u64)))
+
+static int smartlamp_genl_fill_sample(struct sk_buff *skb, u32 portid, u32 seq, int flags,
+                                      int lamp_id, int sensor, const struct smartlamp_sample *sample) {
+    void *hdr = genlmsg_put(skb, portid, seq, &smartlamp_genl_family, flags, SMARTLAMP_CMD_SAMPLE);
+
+    if (!hdr) return -EMSGSIZE;
+    if (nla_put_u32(skb, SMARTLAMP_ATTR_LAMP, lamp_id) ||
+        nla_put_u32(skb, SMARTLAMP_ATTR_SENSOR, sensor) ||
+        nla_put_s32(skb, SMARTLAMP_ATTR_VALUE, sample->value) ||
+        nla_put_u32(skb, SMARTLAMP_ATTR_SCALE, sl_sensors[sensor].scale) ||
+        nla_put_u64_64bit(skb, SMARTLAMP_ATTR_TIME_NS, sample->host_ns, SMARTLAMP_ATTR_PAD)) {
+        genlmsg_cancel(skb, hdr);
+        return -EMSGSIZE;
+    }
+    genlmsg_end(skb, hdr);
+    return 0;
+}
+
+// Mensagens LED e STATE: a lampada e um valor u32
+static int smartlamp_genl_fill_u32(struct sk_buff *skb, u32 portid, u32 seq, int cmd,
+                                   int lamp_id, int attr, u32 value) {
+    void *hdr = genlmsg_put(skb, portid, seq, &smartlamp_genl_family, 0, cmd);
+
+    if (!hdr) return -EMSGSIZE;
+    if (nla_put_u32(skb, SMARTLAMP_ATTR_LAMP, lamp_id) || nla_put_u32(skb, attr, value)) {
+        genlmsg_cancel(skb, hdr);
+        return -EMSGSIZE;
+    }
+    genlmsg_end(skb, hdr);
+    return 0;
+}
+
+// Envia para o grupo "events". Sem inscritos a mensagem nem eh montada.
+static void smartlamp_genl_notify(int cmd, int lamp_id, int sensor, const struct smartlamp_sample *sample,
+                                  int attr, u32 value) {
+    struct sk_buff *skb;
+    int ret;
+
+    if (!genl_has_listeners(&smartlamp_genl_family, &init_net, 0)) return;
+
+    skb = genlmsg_new(SMARTLAMP_GENL_MSG_SIZE, GFP_KERNEL);
+    if (!skb) return;
+    if (cmd == SMARTLAMP_CMD_SAMPLE) ret = smartlamp_genl_fill_sample(skb, 0, 0, 0, lamp_id, sensor, sample);
+    else ret = smartlamp_genl_fill_u32(skb, 0, 0, cmd, lamp_id, attr, value);
+    if (ret) {
+        nlmsg_free(skb);
+        return;
+    }
+    genlmsg_multicast(&smartlamp_genl_family, skb, 0, 0, GFP_KERNEL);
+}
+
+static void smartlamp_genl_sample(struct smartlamp *lamp, int sensor, const struct smartlamp_sample *sample) {
+    smartlamp_genl_notify(SMARTLAMP_CMD_SAMPLE, lamp->id, sensor, sample, 0, 0);
+}
+
+static void smartlamp_genl_led(struct smartlamp *lamp, int value) {
+    smartlamp_genl_notify(SMARTLAMP_CMD_LED, lamp->id, 0, NULL, SMARTLAMP_ATTR_LED, value);
+}
+
+static void smartlamp_genl_state(struct smartlamp *lamp, int state) {
+    smartlamp_genl_notify(SMARTLAMP_CMD_STATE, lamp->id, 0, NULL, SMARTLAMP_ATTR_STATE, state);
+}
+
+// Lampada indicada em SMARTLAMP_ATTR_LAMP, com referencia. NULL se faltar o atributo
+// ou a lampada nao estiver conectada.
+static struct smartlamp *smartlamp_genl_lamp(struct genl_info *info) {
+    if (!info->attrs[SMARTLAMP_ATTR_LAMP]) {
+        GENL_SET_ERR_MSG(info, "falta SMARTLAMP_ATTR_LAMP");
+        return NULL;
+    }
+    return smartlamp_get_by_id(nla_get_u32(info->attrs[SMARTLAMP_ATTR_LAMP]));
+}
+
+// Comando GET_SAMPLES (dump): a ultima amostra de cada sensor de todas as lampadas, como
+// no arquivo samples. Nao acessa a USB; bom para um programa novo saber o estado atual
+// antes de comecar a receber os avisos. cb->args[0] guarda quantas amostras ja foram enviadas.
+static int smartlamp_genl_get_samples(struct sk_buff *skb, struct netlink_callback *cb) {
+    struct smartlamp *lamp;
+    struct smartlamp_sample sample;
+    long pos = 0;
+    int sensor;
+
+    mutex_lock(&smartlamp_list_mutex);
+    list_for_each_entry(lamp, &smartlamp_list, node) {
+        for (sensor = 0; sensor < SL_SENSOR_COUNT; sensor++) {
+            spin_lock(&lamp->sample_lock);
+            sample = lamp->samples[sensor];
+            spin_unlock(&lamp->sample_lock);
+            if (!sample.valid || pos++ < cb->args[0]) continue;
+            if (smartlamp_genl_fill_sample(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq, NLM_F_MULTI,
+                                           lamp->id, sensor, &sample)) {
+                pos--; // nao coube, vai na proxima mensagem
+                goto out;
+            }
+        }
+    }
+out:
+    mutex_unlock(&smartlamp_list_mutex);
+    cb->args[0] = pos;
+    return skb->len;
+}
+
+// Prazo dos comandos do netlink para conseguir a vez da lampada: quem pede pelo canal
+// recebe -ETIMEDOUT em vez de esperar sem limite atras dos outros comandos
+static u64 smartlamp_genl_deadline(void) {
+    return ktime_get_ns() + (u64)GENL_WAIT_MS * NSEC_PER_MSEC;
+}
+
+// Comando GET_SENSOR: le o sensor como o arquivo do sysfs e responde com a amostra.
+// A mesma amostra tambem vai para o grupo "events".
+static int smartlamp_genl_get_sensor(struct sk_buff *skb, struct genl_info *info) {
+    struct smartlamp *lamp;
+    struct smartlamp_sample sample;
+    struct sk_buff *reply;
+    int sensor, ret;
+
+    if (!info->attrs[SMARTLAMP_ATTR_SENSOR]) {
+        GENL_SET_ERR_MSG(info, "falta SMARTLAMP_ATTR_SENSOR");
+        return -EINVAL;
+    }
+    sensor = nla_get_u32(info->attrs[SMARTLAMP_ATTR_SENSOR]);
+    lamp = smartlamp_genl_lamp(info);
+    if (!lamp) return info->attrs[SMARTLAMP_ATTR_LAMP] ? -ENODEV : -EINVAL;
+
+    ret = smartlamp_read_sensor(lamp, sensor, SMARTLAMP_PRIO_ONDEMAND, smartlamp_genl_deadline(), &sample);
+    if (ret == 0) {
+        reply = genlmsg_new(SMARTLAMP_GENL_MSG_SIZE, GFP_KERNEL);
+        if (!reply) ret = -ENOMEM;
+        else ret = smartlamp_genl_fill_sample(reply, info->snd_portid, info->snd_seq, 0, lamp->id, sensor, &sample);
+        if (ret == 0) ret = genlmsg_reply(reply, info);
+        else if (reply) nlmsg_free(reply);
+    }
+    smartlamp_put(lamp);
+    return ret;
+}
+
+// Comando GET_LED: responde com uma mensagem LED
+static int smartlamp_genl_get_led(struct sk_buff *skb, struct genl_info *info) {
+    struct smartlamp *lamp = smartlamp_genl_lamp(info);
+    struct sk_buff *reply;
+    int value, ret;
+
+    if (!lamp) return info->attrs[SMARTLAMP_ATTR_LAMP] ? -ENODEV : -EINVAL;
+
+    ret = smartlamp_get_led(lamp, smartlamp_genl_deadline(), &value);
+    if (ret == 0) {
+        reply = genlmsg_new(SMARTLAMP_GENL_MSG_SIZE, GFP_KERNEL);
+        if (!reply) ret = -ENOMEM;
+        else ret = smartlamp_genl_fill_u32(reply, info->snd_portid, info->snd_seq, SMARTLAMP_CMD_LED,
+                                           lamp->id, SMARTLAMP_ATTR_LED, value);
+        if (ret == 0) ret = genlmsg_reply(reply, info);
+        else if (reply) nlmsg_free(reply);
+    }
+    smartlamp_put(lamp);
+    return ret;
+}
+
+// Comando SET_LED: os mesmos erros da escrita no arquivo led, o resultado chega no ACK
+static int smartlamp_genl_set_led(struct sk_buff *skb, struct genl_info *info) {
+    struct smartlamp *lamp;
+    int ret;
+
+    if (!info->attrs[SMARTLAMP_ATTR_LED]) {
+        GENL_SET_ERR_MSG(info, "falta SMARTLAMP_ATTR_LED");
+        return -EINVAL;
+    }
+    lamp = smartlamp_genl_lamp(info);
+    if (!lamp) return info->attrs[SMARTLAMP_ATTR_LAMP] ? -ENODEV : -EINVAL;
+
+    printk(KERN_INFO "SmartLamp: Alterando valor do LED da lamp%d pelo netlink\n", lamp->id);
+    ret = smartlamp_set_led(lamp, nla_get_u32(info->attrs[SMARTLAMP_ATTR_LED]), smartlamp_genl_deadline());
+    smartlamp_put(lamp);
+    return ret;
+}
+
+static void smartlamp_genl_batch_init(struct smartlamp_genl_batch *msgs) {
+    msgs->skb = NULL;
+    msgs->listeners = genl_has_listeners(&smartlamp_genl_family, &init_net, 0);
+}
+
+static void smartlamp_genl_batch_send(struct smartlamp_genl_batch *msgs) {
+    if (msgs->skb) genlmsg_multicast(&smartlamp_genl_family, msgs->skb, 0, 0, GFP_KERNEL);
+    msgs->skb = NULL;
+}
+
+// Acrescenta uma mensagem SAMPLE; com o skb cheio, envia e comeca outro
+static void smartlamp_genl_batch_add(struct smartlamp_genl_batch *msgs, struct smartlamp *lamp, int sensor,
+                                     const struct smartlamp_sample *sample) {
+    if (!msgs->listeners) return;
+    if (msgs->skb && smartlamp_genl_fill_sample(msgs->skb, 0, 0, 0, lamp->id, sensor, sample) == 0) return;
+
+    smartlamp_genl_batch_send(msgs);
+    msgs->skb = nlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+    if (msgs->skb && smartlamp_genl_fill_sample(msgs->skb, 0, 0, 0, lamp->id, sensor, sample)) {
+        nlmsg_free(msgs->skb);
+        msgs->skb = NULL;
+    }
+}
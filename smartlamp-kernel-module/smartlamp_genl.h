@@ -0,0 +1,57 @@
+#ifndef SMARTLAMP_GENL_H
+#define SMARTLAMP_GENL_H
+
+// Canal generic netlink do driver, compartilhado com os programas (libsmartlamp).
+//
+// Familia "smartlamp" com o grupo multicast "events": toda amostra lida das lampadas
+// (leitura do usuario, aviso do firmware ou leitura periodica) e toda mudanca de estado
+// (LED alterado, lampada conectada, desconectada ou em recuperacao) eh enviada uma vez
+// para todos os inscritos. Varios programas recebem os mesmos dados sem acessar a USB
+// cada um por conta propria.
+//
+// Os comandos tambem chegam pelo canal (NLM_F_REQUEST):
+//   GET_SAMPLES (NLM_F_DUMP)  ultima amostra de cada sensor de todas as lampadas, sem USB
+//   GET_SENSOR  LAMP SENSOR   le um sensor, responde com uma mensagem SAMPLE
+//   GET_LED     LAMP          le o LED, responde com uma mensagem LED
+//   SET_LED     LAMP LED      altera o LED (precisa de CAP_NET_ADMIN), o aviso LED vai para o grupo
+// Os comandos que acessam a USB falham com ETIMEDOUT se a lampada nao atender em 1 s
+// (ocupada com outros comandos ou em recuperacao).
+
+#define SMARTLAMP_GENL_NAME "smartlamp"
+#define SMARTLAMP_GENL_VERSION 1
+#define SMARTLAMP_GENL_MCGRP "events"
+
+enum smartlamp_genl_cmd {
+    SMARTLAMP_CMD_UNSPEC,
+    SMARTLAMP_CMD_SAMPLE,       // aviso/resposta: LAMP SENSOR VALUE SCALE TIME_NS
+    SMARTLAMP_CMD_LED,          // aviso/resposta: LAMP LED
+    SMARTLAMP_CMD_STATE,        // aviso: LAMP STATE
+    SMARTLAMP_CMD_GET_SAMPLES,
+    SMARTLAMP_CMD_GET_SENSOR,
+    SMARTLAMP_CMD_GET_LED,
+    SMARTLAMP_CMD_SET_LED,
+    __SMARTLAMP_CMD_MAX,
+};
+#define SMARTLAMP_CMD_MAX (__SMARTLAMP_CMD_MAX - 1)
+
+enum smartlamp_genl_attr {
+    SMARTLAMP_ATTR_UNSPEC,
+    SMARTLAMP_ATTR_PAD,
+    SMARTLAMP_ATTR_LAMP,        // u32, o N de lampN
+    SMARTLAMP_ATTR_SENSOR,      // u32, posicao na tabela SL_SENSORS (0 = ldr, 1 = temp, 2 = hum)
+    SMARTLAMP_ATTR_VALUE,       // s32, em unidades de 1/scale como no arquivo samples
+    SMARTLAMP_ATTR_SCALE,       // u32
+    SMARTLAMP_ATTR_TIME_NS,     // u64, horario da leitura no CLOCK_MONOTONIC do host
+    SMARTLAMP_ATTR_LED,         // u32, brilho 0 a 100
+    SMARTLAMP_ATTR_STATE,       // u32, enum smartlamp_genl_state
+    __SMARTLAMP_ATTR_MAX,
+};
+#define SMARTLAMP_ATTR_MAX (__SMARTLAMP_ATTR_MAX - 1)
+
+enum smartlamp_genl_state {
+    SMARTLAMP_STATE_ONLINE,     // conectada ou recuperada
+    SMARTLAMP_STATE_OFFLINE,    // desconectada
+    SMARTLAMP_STATE_RECOVERING, // nao responde, comandos falham com ETIMEDOUT ate voltar
+};
+
+#endif // SMARTLAMP_GENL_H
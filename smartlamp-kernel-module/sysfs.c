@@ -6,6 +6,8 @@
 #include <linux/kobject.h> // Adicionado para sysfs
 #include <linux/sysfs.h>   // Adicionado para sysfs
 
+#include "smartlamp_proto.h" // comandos e formato das linhas, o mesmo arquivo usado pelo firmware
+
 MODULE_AUTHOR("DevTITANS <devtitans@icomp.ufam.edu.br>");
 MODULE_DESCRIPTION("Driver de acesso ao SmartLamp (ESP32 com Chip Serial CP2102)");
 MODULE_LICENSE("GPL");
@@ -84,8 +86,10 @@ static int activate_cp210x_uart(void) {
 // Executado quando o dispositivo é conectado na USB
 static int usb_probe(struct usb_interface *interface, const struct usb_device_id *id) {
     struct usb_endpoint_descriptor *usb_endpoint_in, *usb_endpoint_out;
+    char command[MAX_RECV_LINE];
     printk(KERN_INFO "SmartLamp: Dispositivo conectado ...\n");
 
+    sl_proto_init();
     smartlamp_device = interface_to_usbdev(interface);
 
     // 1. ATIVA A UART DO CHIP
@@ -105,7 +109,8 @@ static int usb_probe(struct usb_interface *interface, const struct usb_device_id
 
     // 3. Inicia a comunicação enviando o comando
     msleep(200); // Espera o dispositivo se estabilizar
-    if (usb_write_serial("GET_LDR\n") == 0) {
+    sl_encode_cmd(command, SL_CMD_GET_LDR);
+    if (usb_write_serial(command) == 0) {
         printk(KERN_INFO "SmartLamp: Comando 'GET_LDR' enviado.\n");
         msleep(100); // Espera o dispositivo processar e responder
         LDR_value = usb_read_serial();
@@ -147,6 +152,20 @@ static void usb_disconnect(struct usb_interface *interface) {
     smartlamp_device = NULL; // Adicionado para segurança e prevenção de crashes
 }
 
+// Decodifica a primeira linha recebida com o smartlamp_proto.h, o mesmo formato do
+// firmware e do smartlamp.c. Retorna 0 e o valor (em unidades de 1/escala) se a linha
+// for a resposta "RES <cmd> <valor>".
+static int parse_response(const char *buf, int len, int cmd, int *value) {
+    const char *eol = memchr(buf, '\n', len);
+    struct sl_msg msg;
+
+    if (eol) len = eol - buf;
+    if (sl_parse_line(buf, len, &msg) < 0) return -1;
+    if (msg.kind != SL_MSG_RES || msg.cmd != cmd || !msg.has_value) return -1;
+    *value = msg.value;
+    return 0;
+}
+
 // Função para enviar um comando para o dispositivo
 static int usb_write_serial(const char* command) {
     int ret, actual_size;
@@ -168,8 +187,7 @@ static int usb_read_serial(void) {
     while (retries-- > 0) {
         ret = usb_bulk_msg(smartlamp_device, usb_rcvbulkpipe(smartlamp_device, usb_in), usb_in_buffer, usb_max_size - 1, &actual_size, 1000);
         if (ret == 0) { // Alterado para checar sucesso antes de continuar
-            usb_in_buffer[actual_size] = '\0';
-            if (sscanf(usb_in_buffer, "RES GET_LDR %d", &val) == 1) {
+            if (parse_response(usb_in_buffer, actual_size, SL_CMD_GET_LDR, &val) == 0) {
                 return val;
             }
         }
@@ -183,7 +201,7 @@ static int usb_read_serial(void) {
 // Função chamada quando algo é escrito no arquivo /sys/kernel/smartlamp/led
 static ssize_t led_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
     int new_value;
-    char command[32];
+    char command[MAX_RECV_LINE];
 
     if (!smartlamp_device) return -ENODEV; // Verificação de segurança
 
@@ -193,7 +211,7 @@ static ssize_t led_store(struct kobject *kobj, struct kobj_attribute *attr, cons
 
     if (activate_cp210x_uart() < 0) return -EIO;
 
-    scnprintf(command, sizeof(command), "SET_LED %d\n", new_value);
+    sl_encode_cmd_value(command, SL_CMD_SET_LED, new_value, 1);
     
     if (usb_write_serial(command) == 0) {
         // Consome a resposta de confirmação ("RES SET_LED 1") para não travar
@@ -208,6 +226,7 @@ static ssize_t led_store(struct kobject *kobj, struct kobj_attribute *attr, cons
 // Função chamada quando o arquivo /sys/kernel/smartlamp/led é lido
 static ssize_t led_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
     int value = -1;
+    char command[MAX_RECV_LINE];
     int ret, actual_size;
     int retries = 5;
 
@@ -215,14 +234,14 @@ static ssize_t led_show(struct kobject *kobj, struct kobj_attribute *attr, char
 
     if (activate_cp210x_uart() < 0) return sprintf(buf, "%d\n", -1);
 
-    if (usb_write_serial("GET_LED\n") == 0) {
+    sl_encode_cmd(command, SL_CMD_GET_LED);
+    if (usb_write_serial(command) == 0) {
         msleep(100);
         while (retries-- > 0) {
             ret = usb_bulk_msg(smartlamp_device, usb_rcvbulkpipe(smartlamp_device, usb_in), 
                                usb_in_buffer, MAX_RECV_LINE - 1, &actual_size, 1000);
             if (ret == 0) {
-                usb_in_buffer[actual_size] = '\0';
-                sscanf(usb_in_buffer, "RES GET_LED %d", &value);
+                parse_response(usb_in_buffer, actual_size, SL_CMD_GET_LED, &value);
                 printk(KERN_INFO "SmartLamp: Lendo valor do LED: %d\n", value);
                 goto end_show;
             }
@@ -237,6 +256,8 @@ end_show:
 // Função chamada quando o arquivo /sys/kernel/smartlamp/temp é lido
 static ssize_t temp_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
     int value = -1;
+    bool got = false;
+    char command[MAX_RECV_LINE];
     int ret, actual_size;
     int retries = 5;
 
@@ -244,14 +265,14 @@ static ssize_t temp_show(struct kobject *kobj, struct kobj_attribute *attr, char
 
     if (activate_cp210x_uart() < 0) return sprintf(buf, "%d\n", -1);
 
-    if (usb_write_serial("GET_TEMP\n") == 0) {
+    sl_encode_cmd(command, SL_CMD_GET_TEMP);
+    if (usb_write_serial(command) == 0) {
         msleep(100);
         while (retries-- > 0) {
             ret = usb_bulk_msg(smartlamp_device, usb_rcvbulkpipe(smartlamp_device, usb_in), 
                                usb_in_buffer, MAX_RECV_LINE - 1, &actual_size, 1000);
             if (ret == 0) {
-                usb_in_buffer[actual_size] = '\0';
-                sscanf(usb_in_buffer, "RES GET_TEMP %d", &value);
+                got = parse_response(usb_in_buffer, actual_size, SL_CMD_GET_TEMP, &value) == 0;
                 printk(KERN_INFO "SmartLamp: Lendo valor da Temperatura: %d\n", value);
                 goto end_show;
             }
@@ -260,12 +281,18 @@ static ssize_t temp_show(struct kobject *kobj, struct kobj_attribute *attr, char
         printk(KERN_ERR "SmartLamp: sysfs 'temp_show' falhou ao ler resposta. Erro: %d\n", ret);
     }
 end_show:
-    return sprintf(buf, "%d\n", value);
+    // o valor vem em ponto fixo ("23.50" = 2350), escrito com as casas decimais do sensor
+    if (!got) return sprintf(buf, "%d\n", -1);
+    ret = sl_put_fixed(buf, value, sl_sensors[SL_SENSOR_TEMP].scale);
+    buf[ret++] = '\n';
+    return ret;
 }
 
 // Função chamada quando o arquivo /sys/kernel/smartlamp/hum é lido
 static ssize_t hum_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
     int value = -1;
+    bool got = false;
+    char command[MAX_RECV_LINE];
     int ret, actual_size;
     int retries = 5;
 
@@ -273,14 +300,14 @@ static ssize_t hum_show(struct kobject *kobj, struct kobj_attribute *attr, char
 
     if (activate_cp210x_uart() < 0) return sprintf(buf, "%d\n", -1);
 
-    if (usb_write_serial("GET_HUM\n") == 0) {
+    sl_encode_cmd(command, SL_CMD_GET_HUM);
+    if (usb_write_serial(command) == 0) {
         msleep(100);
         while (retries-- > 0) {
             ret = usb_bulk_msg(smartlamp_device, usb_rcvbulkpipe(smartlamp_device, usb_in), 
                                usb_in_buffer, MAX_RECV_LINE - 1, &actual_size, 1000);
             if (ret == 0) {
-                usb_in_buffer[actual_size] = '\0';
-                sscanf(usb_in_buffer, "RES GET_HUM %d", &value);
+                got = parse_response(usb_in_buffer, actual_size, SL_CMD_GET_HUM, &value) == 0;
                 printk(KERN_INFO "SmartLamp: Lendo valor da Umidade: %d\n", value);
                 goto end_show;
             }
@@ -289,5 +316,9 @@ static ssize_t hum_show(struct kobject *kobj, struct kobj_attribute *attr, char
         printk(KERN_ERR "SmartLamp: sysfs 'hum_show' falhou ao ler resposta. Erro: %d\n", ret);
     }
 end_show:
-    return sprintf(buf, "%d\n", value);
+    // o valor vem em ponto fixo ("23.50" = 2350), escrito com as casas decimais do sensor
+    if (!got) return sprintf(buf, "%d\n", -1);
+    ret = sl_put_fixed(buf, value, sl_sensors[SL_SENSOR_HUM].scale);
+    buf[ret++] = '\n';
+    return ret;
 }
\ No newline at end of file
@@ -1,11 +1,15 @@
 #include <Adafruit_Sensor.h>
 #include <DHT.h>
 #include <DHT_U.h>
+#include <esp_timer.h> // relogio em microssegundos desde o boot
+#include <math.h>
+#include "smartlamp_proto.h" // comandos e formato das linhas, o mesmo arquivo usado pelo driver
 
 #define DHTTYPE DHT11
 
 int ledPin = 5;
 int ledValue = 10; // 10 de 255, convertido = 4
+int ledPending = -1; // valor guardado pelo PREP_LED, aplicado no COMMIT_LED (-1 = nenhum)
 int dhtPin = 15;
 int ldrPin = 34;
 int ldrMax = 4045;
@@ -14,57 +18,202 @@ int ldrMax = 4045;
 
 DHT dht(dhtPin, DHTTYPE);
 
+// O DHT11 so faz uma medida nova a cada 2 s e, dentro desse intervalo, a biblioteca devolve
+// a anterior. Por isso a medida eh feita aqui, guardando o horario em que ela aconteceu, e
+// as amostras de temp e hum levam esse horario e nao o do pedido.
+#define DHT_MIN_INTERVAL_MS 2000
+float dhtTemperature = NAN;
+float dhtHumidity = NAN;
+uint64_t dhtSampleUs = 0;    // horario da ultima medida do DHT
+unsigned long dhtLastRead;
+bool dhtStarted = false;
+
+// --- Avisos de mudanca ---
+// Com SET_EVT o driver pede para ser avisado quando um sensor mudar, assim ele nao precisa
+// ficar perguntando. O aviso eh a linha "EVT <SENSOR> <valor> @<us>", enviada quando:
+//  - o valor mudou pelo menos 'delta' desde o ultimo aviso (delta 0 = desligado), ou
+//  - o valor passou de threshold + hyst ou caiu abaixo de threshold - hyst
+// Os valores ficam em ponto fixo, na escala do sensor (centesimos para temp e hum).
+struct EventConfig {
+    int32_t delta;
+    bool thresholdEnabled;
+    int32_t threshold;
+    int32_t hyst;
+    bool reported;       // ja enviou o primeiro aviso desde o SET_EVT
+    int32_t lastReported;
+    bool above;          // lado do threshold em que o valor estava no ultimo aviso
+    unsigned long lastCheck;
+};
+
+EventConfig events[SL_SENSOR_COUNT];
+// ms entre leituras de cada sensor, da tabela SL_SENSORS (o DHT11 nao le mais rapido que 2 s)
+const unsigned long eventPeriod[SL_SENSOR_COUNT] = {
+#define SL_X(id, name, scale, periodMs, read) periodMs,
+    SL_SENSORS(SL_X)
+#undef SL_X
+};
+
+// Leitura de cada sensor, da tabela SL_SENSORS: valor em ponto fixo e horario em que o
+// hardware mediu esse valor, falso se falhou
+typedef bool (*SensorRead)(int32_t *value, uint64_t *sampleUs);
+#define SL_X(id, name, scale, periodMs, read) bool read(int32_t *value, uint64_t *sampleUs);
+SL_SENSORS(SL_X)
+#undef SL_X
+const SensorRead sensorRead[SL_SENSOR_COUNT] = {
+#define SL_X(id, name, scale, periodMs, read) read,
+    SL_SENSORS(SL_X)
+#undef SL_X
+};
+
+// --- Lotes de amostras ---
+// Com SET_BATCH todos os sensores sao lidos a cada batchPeriod ms e os registros sao
+// acumulados ja codificados em batchLine (ver "Lotes de amostras" em smartlamp_proto.h).
+// A linha eh enviada quando chega a batchRecords registros ou quando nao cabe mais um.
+// O envio nao bloqueia o loop: a linha pronta vai para batchTx e cada volta do loop escreve
+// so o que cabe no buffer de saida da serial (Serial.availableForWrite()), enquanto o
+// proximo lote ja eh montado em batchLine.
+unsigned long batchPeriod = 0; // 0 = desligado
+int batchRecords = 0;
+int batchCount = 0;            // registros na linha atual
+unsigned long batchLastSample;
+struct sl_batch batch;
+char batchLine[SL_MAX_BATCH_LINE];
+size_t batchLen = 0;
+char batchTx[SL_MAX_BATCH_LINE]; // lote sendo enviado, de batchTxPos ate batchTxLen
+size_t batchTxLen = 0;
+size_t batchTxPos = 0;
+
+// Linha recebida pela serial, montada byte a byte sem alocar memoria
+char line[SL_MAX_LINE];
+size_t lineLen = 0;
+bool lineOverflow = false; // linha maior que o buffer, descarta ate o proximo '\n'
+char out[SL_MAX_LINE];     // resposta sendo montada
+
 void setup() {
     Serial.begin(115200);
     pinMode(ledPin, OUTPUT);
     pinMode(ldrPin, INPUT);
     dht.begin();
     delay(2000); // delay pro dht estabilizar
-    processCommand("GET_TEMP");
-    processCommand("GET_HUM");
+    sl_proto_init();
+    dhtUpdate();
     Serial.println("SmartLamp Initialized and Ready.");
 }
 
 void loop() { 
-    if (Serial.available()) {
-        String command = Serial.readStringUntil('\n');
-        command.trim();
-        processCommand(command);
-
-        // consome qualquer dado residual (eco/lixo) do buffer
-        // para garantir que o comando não seja lido novamente em loop.
-        while (Serial.available()) {
-            Serial.read();
+    // Junta os bytes recebidos ate o '\n' e processa cada linha completa.
+    // Bytes que chegam junto com o comando ja sao o proximo comando, nao sao descartados.
+    while (Serial.available()) {
+        char c = Serial.read();
+        if (c == '\n') {
+            // linha vazia nao eh comando, o driver usa um '\n' para ressincronizar a serial
+            if (!lineOverflow && lineLen > 0) processCommand(line, lineLen);
+            lineLen = 0;
+            lineOverflow = false;
+        } else if (lineLen < sizeof(line)) {
+            line[lineLen++] = c;
+        } else {
+            lineOverflow = true;
         }
     }
-    
+
+    eventCheck();
+    batchCheck();
+}
+
+// Envia a linha em out. O resto de um lote que esteja sendo enviado vai antes, para as
+// duas linhas nao se misturarem na serial.
+void sendLine(size_t len) {
+    batchDrain();
+    Serial.write((const uint8_t *)out, len);
 }
 
-void processCommand(String command) {
-    if (command.startsWith("SET_LED")) {
-        // Extrai o valor após "SET_LED "
-        int newValue = command.substring(8).toInt();
-        if (newValue >= 0 && newValue <= 100) {
-            ledUpdate(newValue);
-            Serial.println("RES SET_LED 1");
+// Le um valor "<numero>" no fim de args, em ponto fixo na escala dada
+bool parseValue(const char *args, const char *end, int32_t scale, int32_t *value) {
+    if (sl_parse_fixed(&args, end, scale, value)) return false;
+    sl_skip_spaces(&args, end);
+    return args == end;
+}
+
+void processCommand(const char *command, size_t len) {
+    const char *args;
+    const char *end = command + len;
+    int32_t value;
+    uint64_t now;
+    uint64_t sampleUs;
+    int cmd = sl_parse_cmd(command, len, &args);
+
+    while (end > args && (end[-1] == '\r' || end[-1] == ' ')) end--;
+
+    switch (cmd) {
+    case SL_CMD_SET_LED:
+        if (parseValue(args, end, 1, &value) && value >= 0 && value <= 100) {
+            ledUpdate(value);
+            sendLine(sl_encode_res(out, cmd, 1, 0));
         } else {
-            Serial.println("RES SET_LED -1");
+            sendLine(sl_encode_res(out, cmd, -1, 0));
         }
-    }
-    else if (command == "GET_LED") {
-        Serial.printf("RES GET_LED %d\n", ledGetValue());
-    }
-    else if (command == "GET_LDR") {
-        Serial.printf("RES GET_LDR %d\n", ldrGetValue());
-    }
-    else if (command == "GET_TEMP") {
-        Serial.printf("RES GET_TEMP %.2f\n", tempGetValue());
-    }
-    else if (command == "GET_HUM") {
-        Serial.printf("RES GET_HUM %.2f\n", humGetValue());
-    }
-    else {
-        Serial.println("ERR Unknown command.");
+        break;
+    // Atualizacao em grupo: o driver manda PREP_LED para todas as lampadas,
+    // e depois COMMIT_LED para que todas mudem juntas
+    case SL_CMD_PREP_LED:
+        if (parseValue(args, end, 1, &value) && value >= 0 && value <= 100) {
+            ledPending = value;
+            sendLine(sl_encode_res(out, cmd, 1, 0));
+        } else {
+            sendLine(sl_encode_res(out, cmd, -1, 0));
+        }
+        break;
+    case SL_CMD_COMMIT_LED:
+        if (ledPending >= 0) {
+            ledUpdate(ledPending);
+            ledPending = -1;
+            sendLine(sl_encode_res(out, cmd, 1, 0));
+        } else {
+            sendLine(sl_encode_res(out, cmd, -1, 0));
+        }
+        break;
+    case SL_CMD_ABORT_LED:
+        ledPending = -1;
+        sendLine(sl_encode_res(out, cmd, 1, 0));
+        break;
+    case SL_CMD_GET_LED:
+        sendLine(sl_encode_res(out, cmd, ledGetValue(), 0));
+        break;
+    case SL_CMD_SET_EVT:
+        // SET_EVT <SENSOR> <delta> [<threshold> <hyst>]
+        if (eventConfigure(args, end)) {
+            sendLine(sl_encode_res(out, cmd, 1, 0));
+        } else {
+            sendLine(sl_encode_res(out, cmd, -1, 0));
+        }
+        break;
+    case SL_CMD_SET_BATCH:
+        // SET_BATCH <periodo em ms> <registros por lote>
+        if (batchConfigure(args, end)) {
+            sendLine(sl_encode_res(out, cmd, 1, 0));
+        } else {
+            sendLine(sl_encode_res(out, cmd, -1, 0));
+        }
+        break;
+    case SL_CMD_GET_TIME:
+        now = timeGetValue();
+        sendLine(sl_encode_time(out, now));
+        break;
+    default:
+        // As leituras de sensor (GET_<SENSOR>) levam o horario da amostra no final
+        // ("@<us desde o boot>"), o driver usa o GET_TIME para converter esse horario
+        // para o relogio do host
+        if (cmd != SL_NONE && sl_cmds[cmd].sensor != SL_NONE) {
+            if (sensorGetValue(sl_cmds[cmd].sensor, &value, &sampleUs)) {
+                sendLine(sl_encode_res(out, cmd, value, sampleUs));
+            } else {
+                sendLine(sl_encode_err(out, cmd)); // leitura do sensor falhou
+            }
+            break;
+        }
+        sendLine(sl_encode_err(out, SL_NONE));
+        break;
     }
 }
 
@@ -88,12 +237,206 @@ int ldrGetValue() {
     return ldrNormalizedValue;
 }
 
+// Faz uma medida nova no DHT se a anterior tem pelo menos 2 s
+void dhtUpdate() {
+    if (dhtStarted && millis() - dhtLastRead < DHT_MIN_INTERVAL_MS) return;
+    dhtStarted = true;
+    dhtLastRead = millis();
+    dhtSampleUs = timeGetValue();
+    dhtTemperature = dht.readTemperature(false, true); // force: mede agora
+    dhtHumidity = dht.readHumidity(); // mesma medida, ja guardada pela biblioteca
+}
+
 float tempGetValue(){
-  float temperature = dht.readTemperature();
-  return temperature;
+  dhtUpdate();
+  return dhtTemperature;
 }
 
 float humGetValue(){
-  float humidity = dht.readHumidity();
-  return humidity;
+  dhtUpdate();
+  return dhtHumidity;
+}
+
+// Relogio do ESP32 em microssegundos desde o boot (64 bits, nao da a volta)
+long long timeGetValue() {
+  return (long long)esp_timer_get_time();
+}
+
+// Converte uma leitura do DHT para ponto fixo na escala do sensor, falso se ela falhou
+bool fixedValue(int sensor, float reading, int32_t *value) {
+    if (isnan(reading)) return false;
+    *value = lroundf(reading * sl_sensors[sensor].scale);
+    return true;
+}
+
+bool ldrRead(int32_t *value, uint64_t *sampleUs) {
+    *sampleUs = timeGetValue();
+    *value = ldrGetValue();
+    return true;
+}
+
+bool tempRead(int32_t *value, uint64_t *sampleUs) {
+    if (!fixedValue(SL_SENSOR_TEMP, tempGetValue(), value)) return false;
+    *sampleUs = dhtSampleUs;
+    return true;
+}
+
+bool humRead(int32_t *value, uint64_t *sampleUs) {
+    if (!fixedValue(SL_SENSOR_HUM, humGetValue(), value)) return false;
+    *sampleUs = dhtSampleUs;
+    return true;
+}
+
+// Le um sensor em ponto fixo (valor * escala do sensor) e o horario da medida, falso se a
+// leitura falhou
+bool sensorGetValue(int sensor, int32_t *value, uint64_t *sampleUs) {
+    if (sensor < 0 || sensor >= SL_SENSOR_COUNT) return false;
+    return sensorRead[sensor](value, sampleUs);
+}
+
+// Interpreta os argumentos do SET_EVT: "<SENSOR> <delta> [<threshold> <hyst>]"
+bool eventConfigure(const char *args, const char *end) {
+    const char *token;
+    size_t tokenLen = sl_token(&args, end, &token);
+    int sensor = sl_lookup_sensor(token, tokenLen);
+    int32_t values[3];
+    int n;
+
+    if (sensor == SL_NONE) return false;
+    for (n = 0; n < 3; n++) {
+        sl_skip_spaces(&args, end);
+        if (args == end) break;
+        if (sl_parse_fixed(&args, end, sl_sensors[sensor].scale, &values[n])) return false;
+    }
+    sl_skip_spaces(&args, end);
+    if (args != end || (n != 1 && n != 3)) return false;
+    if (values[0] < 0 || (n == 3 && values[2] < 0)) return false;
+
+    events[sensor].delta = values[0];
+    events[sensor].thresholdEnabled = (n == 3);
+    events[sensor].threshold = n == 3 ? values[1] : 0;
+    events[sensor].hyst = n == 3 ? values[2] : 0;
+    events[sensor].reported = false;
+    return true;
+}
+
+// Le os sensores com aviso ligado e envia "EVT" quando passam do delta ou do threshold
+void eventCheck() {
+    unsigned long now = millis();
+
+    for (int i = 0; i < SL_SENSOR_COUNT; i++) {
+        EventConfig &config = events[i];
+        if (config.delta <= 0 && !config.thresholdEnabled) continue;
+        if (now - config.lastCheck < eventPeriod[i]) continue;
+        config.lastCheck = now;
+
+        int32_t value;
+        uint64_t sampleUs;
+        if (!sensorGetValue(i, &value, &sampleUs)) continue;
+
+        bool report = !config.reported;
+        if (config.delta > 0 && abs(value - config.lastReported) >= config.delta) {
+            report = true;
+        }
+        if (config.thresholdEnabled) {
+            if (!config.reported) {
+                config.above = value > config.threshold;
+            } else if (!config.above && value >= config.threshold + config.hyst) {
+                config.above = true;
+                report = true;
+            } else if (config.above && value <= config.threshold - config.hyst) {
+                config.above = false;
+                report = true;
+            }
+        }
+        if (!report) continue;
+
+        config.reported = true;
+        config.lastReported = value;
+        sendLine(sl_encode_evt(out, i, value, sampleUs));
+    }
+}
+
+// Interpreta os argumentos do SET_BATCH: "<periodo em ms> <registros>", periodo 0 desliga.
+// O lote que estava sendo montado eh enviado antes de mudar a configuracao.
+bool batchConfigure(const char *args, const char *end) {
+    int32_t period, records;
+
+    if (sl_parse_fixed(&args, end, 1, &period)) return false;
+    sl_skip_spaces(&args, end);
+    if (sl_parse_fixed(&args, end, 1, &records)) return false;
+    sl_skip_spaces(&args, end);
+    if (args != end) return false;
+    if (period != 0 && (period < SL_BATCH_MIN_PERIOD_MS || period > SL_BATCH_MAX_PERIOD_MS ||
+                        records < 1 || records > SL_BATCH_MAX_RECORDS)) return false;
+
+    batchDrain();
+    batchFlush();
+    batchPeriod = period;
+    batchRecords = records;
+    batchLastSample = millis() - period; // primeira leitura ja na proxima volta do loop
+    return true;
+}
+
+// Passa o lote que estiver sendo montado para o envio.
+// Falso se o lote anterior ainda esta sendo enviado, o atual continua em batchLine.
+bool batchFlush() {
+    if (batchCount == 0) return true;
+    if (batchTxPos < batchTxLen) return false;
+    batchLen += sl_end_line(batchLine + batchLen);
+    memcpy(batchTx, batchLine, batchLen);
+    batchTxLen = batchLen;
+    batchTxPos = 0;
+    batchCount = 0;
+    batchLen = 0;
+    batchSend();
+    return true;
+}
+
+// Escreve o que couber do lote em envio sem esperar a serial
+void batchSend() {
+    size_t n = batchTxLen - batchTxPos;
+    size_t room = Serial.availableForWrite();
+
+    if (n > room) n = room;
+    if (n == 0) return;
+    Serial.write((const uint8_t *)batchTx + batchTxPos, n);
+    batchTxPos += n;
+}
+
+// Termina de enviar o lote em envio, esperando a serial se precisar
+void batchDrain() {
+    if (batchTxPos == batchTxLen) return;
+    Serial.write((const uint8_t *)batchTx + batchTxPos, batchTxLen - batchTxPos);
+    batchTxPos = batchTxLen;
+}
+
+// Le todos os sensores a cada batchPeriod e acrescenta o registro ao lote
+void batchCheck() {
+    int32_t values[SL_SENSOR_COUNT];
+    uint8_t valid[SL_SENSOR_COUNT];
+    unsigned long now = millis();
+    uint64_t sampleUs;
+
+    batchSend();
+    if (batchCount > 0 && batchCount >= batchRecords) batchFlush(); // lote completo esperando o envio anterior
+    if (!batchPeriod || now - batchLastSample < batchPeriod) return;
+    batchLastSample += batchPeriod; // mantem o ritmo mesmo se esta volta do loop atrasou
+    if (now - batchLastSample >= batchPeriod) batchLastSample = now; // atrasou mais de um periodo
+
+    // o '\n' e o '\0' do final precisam caber junto com o registro. Se a linha estiver cheia
+    // e o lote anterior ainda nao terminou de sair, a serial nao acompanha o periodo pedido
+    // e esta leitura eh descartada.
+    if (batchCount > 0 && batchLen + SL_BATCH_RECORD_MAX + 2 > sizeof(batchLine) && !batchFlush()) return;
+
+    // O registro tem um horario so, o do inicio das leituras. Um sensor que devolveu uma
+    // medida anterior a ele (o DHT entre duas medidas) fica como nao lido neste registro.
+    sampleUs = timeGetValue();
+    for (int i = 0; i < SL_SENSOR_COUNT; i++) {
+        uint64_t us;
+        valid[i] = sensorGetValue(i, &values[i], &us) && us >= sampleUs;
+    }
+    if (batchCount == 0) batchLen = sl_batch_start(batchLine, &batch, sampleUs);
+    batchLen += sl_batch_put(batchLine + batchLen, &batch, sampleUs, values, valid);
+    if (++batchCount >= batchRecords) batchFlush();
 }
@@ -0,0 +1,607 @@
+#ifndef SMARTLAMP_PROTO_H
+#define SMARTLAMP_PROTO_H
+
+// Protocolo serial do SmartLamp, compartilhado entre o firmware (smartlamp.ino) e o
+// driver (smartlamp-kernel-module/smartlamp.c).
+//
+// Os comandos e sensores sao definidos uma unica vez nas tabelas X-macro abaixo. Os enums,
+// os nomes, a busca de comandos e os codificadores/decodificadores dos dois lados sao gerados
+// a partir delas, sem alocacao de memoria e sem sscanf/printf.
+//
+// Formato das linhas (terminadas por '\n'):
+//   comando:  "<NOME> [args]"
+//   resposta: "RES <NOME> <valor> [@<us do firmware>]"
+//   erro:     "ERR <NOME>" ou "ERR <texto>"
+//   aviso:    "EVT <SENSOR> <valor> @<us do firmware>"
+//   lote:     "BAT @<us do firmware> <registros>" (ver "Lotes de amostras" abaixo)
+//
+// Valores sao numeros com casas decimais ("23.50") e sao guardados como inteiros em unidades
+// de 1/escala do sensor (2350 com escala 100).
+//
+// Os sensores ficam na tabela SL_SENSORS de smartlamp_sensors.h: o comando GET_<SENSOR>, o
+// aviso EVT <SENSOR>, o arquivo no sysfs e a leitura no firmware sao gerados a partir dela.
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#endif
+
+#include "smartlamp_sensors.h"
+
+#define SL_MAX_LINE 100 // tamanho maximo de uma linha, incluindo o '\n'
+#define SL_MAX_BATCH_LINE 256 // a linha "BAT ...", a unica que pode passar de SL_MAX_LINE
+
+// Comandos que nao sao leitura de sensor
+#define SL_COMMANDS(X) \
+    X(GET_LED)         \
+    X(SET_LED)         \
+    X(PREP_LED)        \
+    X(COMMIT_LED)      \
+    X(ABORT_LED)       \
+    X(GET_TIME)        \
+    X(SET_EVT)         \
+    X(SET_BATCH)
+
+enum sl_sensor {
+#define SL_X(id, name, scale, period_ms, read) SL_SENSOR_##id,
+    SL_SENSORS(SL_X)
+#undef SL_X
+    SL_SENSOR_COUNT
+};
+
+// os comandos GET_<SENSOR> vem depois dos comandos fixos
+enum sl_cmd {
+#define SL_X(id) SL_CMD_##id,
+    SL_COMMANDS(SL_X)
+#undef SL_X
+#define SL_X(id, name, scale, period_ms, read) SL_CMD_GET_##id,
+    SL_SENSORS(SL_X)
+#undef SL_X
+    SL_CMD_COUNT
+};
+
+#define SL_NONE (-1) // comando ou sensor desconhecido
+
+struct sl_sensor_info {
+    const char *wire;   // nome no protocolo ("TEMP")
+    const char *name;   // nome no sysfs ("temp")
+    uint8_t len;        // strlen(wire)
+    int32_t scale;
+};
+
+static const struct sl_sensor_info sl_sensors[SL_SENSOR_COUNT] = {
+#define SL_X(id, name, scale, period_ms, read) { #id, name, sizeof(#id) - 1, scale },
+    SL_SENSORS(SL_X)
+#undef SL_X
+};
+
+struct sl_cmd_info {
+    const char *name;
+    uint8_t len;        // strlen(name)
+    int8_t sensor;      // sensor lido pelo comando, ou SL_NONE
+};
+
+static const struct sl_cmd_info sl_cmds[SL_CMD_COUNT] = {
+#define SL_X(id) { #id, sizeof(#id) - 1, SL_NONE },
+    SL_COMMANDS(SL_X)
+#undef SL_X
+#define SL_X(id, name, scale, period_ms, read) { "GET_" #id, sizeof("GET_" #id) - 1, SL_SENSOR_##id },
+    SL_SENSORS(SL_X)
+#undef SL_X
+};
+
+// Comando GET_<SENSOR> de um sensor
+static inline int sl_sensor_cmd(int sensor) {
+    return SL_CMD_COUNT - SL_SENSOR_COUNT + sensor;
+}
+
+// Escala do valor na resposta de um comando (1 para comandos que nao leem sensor)
+static inline int32_t sl_cmd_scale(int cmd) {
+    return sl_cmds[cmd].sensor == SL_NONE ? 1 : sl_sensors[sl_cmds[cmd].sensor].scale;
+}
+
+// --- Busca de nomes ---
+// Tabelas hash com enderecamento aberto, montadas uma vez por sl_proto_init(). A busca
+// calcula o hash do nome e compara com uma ou poucas entradas, em vez de comparar o nome
+// com cada comando da lista.
+
+#define SL_HASH_SIZE 32 // potencia de 2, pelo menos o dobro do numero de nomes
+
+typedef char sl_hash_size_check[(2 * SL_CMD_COUNT <= SL_HASH_SIZE && 2 * SL_SENSOR_COUNT <= SL_HASH_SIZE) ? 1 : -1];
+
+static int8_t sl_cmd_hash[SL_HASH_SIZE];
+static int8_t sl_sensor_hash[SL_HASH_SIZE];
+
+// FNV-1a
+static inline uint32_t sl_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline void sl_hash_insert(int8_t *table, const char *name, size_t len, int index) {
+    uint32_t slot = sl_hash(name, len) & (SL_HASH_SIZE - 1);
+
+    while (table[slot] != SL_NONE) slot = (slot + 1) & (SL_HASH_SIZE - 1);
+    table[slot] = (int8_t)index;
+}
+
+// Monta as tabelas de busca, deve ser chamada uma vez antes de qualquer outra funcao
+static inline void sl_proto_init(void) {
+    int i;
+
+    memset(sl_cmd_hash, SL_NONE, sizeof(sl_cmd_hash));
+    memset(sl_sensor_hash, SL_NONE, sizeof(sl_sensor_hash));
+    for (i = 0; i < SL_CMD_COUNT; i++) sl_hash_insert(sl_cmd_hash, sl_cmds[i].name, sl_cmds[i].len, i);
+    for (i = 0; i < SL_SENSOR_COUNT; i++) sl_hash_insert(sl_sensor_hash, sl_sensors[i].wire, sl_sensors[i].len, i);
+}
+
+// Retorna o comando com esse nome, ou SL_NONE
+static inline int sl_lookup_cmd(const char *s, size_t len) {
+    uint32_t slot = sl_hash(s, len) & (SL_HASH_SIZE - 1);
+    int i;
+
+    while ((i = sl_cmd_hash[slot]) != SL_NONE) {
+        if (sl_cmds[i].len == len && !memcmp(sl_cmds[i].name, s, len)) return i;
+        slot = (slot + 1) & (SL_HASH_SIZE - 1);
+    }
+    return SL_NONE;
+}
+
+// Retorna o sensor com esse nome no protocolo ("TEMP"), ou SL_NONE
+static inline int sl_lookup_sensor(const char *s, size_t len) {
+    uint32_t slot = sl_hash(s, len) & (SL_HASH_SIZE - 1);
+    int i;
+
+    while ((i = sl_sensor_hash[slot]) != SL_NONE) {
+        if (sl_sensors[i].len == len && !memcmp(sl_sensors[i].wire, s, len)) return i;
+        slot = (slot + 1) & (SL_HASH_SIZE - 1);
+    }
+    return SL_NONE;
+}
+
+// --- Leitura de campos ---
+// Todas recebem o cursor *p e o fim da linha, e avancam o cursor.
+
+static inline void sl_skip_spaces(const char **p, const char *end) {
+    while (*p < end && **p == ' ') (*p)++;
+}
+
+// Le uma palavra (ate espaco ou fim) e devolve o tamanho
+static inline size_t sl_token(const char **p, const char *end, const char **token) {
+    sl_skip_spaces(p, end);
+    *token = *p;
+    while (*p < end && **p != ' ') (*p)++;
+    return *p - *token;
+}
+
+static inline int sl_parse_u64(const char **p, const char *end, uint64_t *out) {
+    const char *s = *p;
+    uint64_t value = 0;
+
+    if (s == end || *s < '0' || *s > '9') return -1;
+    while (s < end && *s >= '0' && *s <= '9') value = value * 10 + (*s++ - '0');
+    *out = value;
+    *p = s;
+    return 0;
+}
+
+// Le um numero com casas decimais ("-23.5") em unidades de 1/scale (-2350)
+static inline int sl_parse_fixed(const char **p, const char *end, int32_t scale, int32_t *out) {
+    const char *s = *p;
+    int negative = 0;
+    int32_t integer = 0, frac = 0, div = scale;
+
+    if (s < end && *s == '-') { negative = 1; s++; }
+    if (s == end || *s < '0' || *s > '9') return -1;
+    while (s < end && *s >= '0' && *s <= '9') {
+        if (integer > 100000000 / scale) return -1; // estouraria o int32
+        integer = integer * 10 + (*s++ - '0');
+    }
+    if (s < end && *s == '.') {
+        s++;
+        while (s < end && *s >= '0' && *s <= '9') {
+            if (div > 1) { div /= 10; frac += (*s - '0') * div; }
+            s++;
+        }
+    }
+    *out = integer * scale + frac;
+    if (negative) *out = -*out;
+    *p = s;
+    return 0;
+}
+
+// --- Escrita de campos ---
+// Escrevem em p e devolvem o numero de caracteres escritos. Os codificadores de linha
+// esperam um buffer de pelo menos SL_MAX_LINE bytes e terminam a linha com '\n' e '\0'.
+
+static inline size_t sl_put_str(char *p, const char *s, size_t len) {
+    memcpy(p, s, len);
+    return len;
+}
+
+static inline size_t sl_put_u32(char *p, uint32_t value) {
+    char tmp[10];
+    size_t n = 0, i;
+
+    do {
+        tmp[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    for (i = 0; i < n; i++) p[i] = tmp[n - 1 - i];
+    return n;
+}
+
+// Escreve um valor em unidades de 1/scale como numero com casas decimais (2350 -> "23.50")
+static inline size_t sl_put_fixed(char *p, int32_t value, int32_t scale) {
+    size_t n = 0;
+    uint32_t abs_value = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    uint32_t frac = abs_value % scale;
+    int32_t d;
+
+    if (value < 0) p[n++] = '-';
+    n += sl_put_u32(p + n, abs_value / scale);
+    if (scale > 1) {
+        p[n++] = '.';
+        for (d = scale / 10; d > 0; d /= 10) p[n++] = '0' + (frac / d) % 10;
+    }
+    return n;
+}
+
+static inline size_t sl_end_line(char *p) {
+    p[0] = '\n';
+    p[1] = '\0';
+    return 1;
+}
+
+// "<NOME>\n"
+static inline size_t sl_encode_cmd(char *buf, int cmd) {
+    size_t n = sl_put_str(buf, sl_cmds[cmd].name, sl_cmds[cmd].len);
+    return n + sl_end_line(buf + n);
+}
+
+// "<NOME> <valor>\n"
+static inline size_t sl_encode_cmd_value(char *buf, int cmd, int32_t value, int32_t scale) {
+    size_t n = sl_put_str(buf, sl_cmds[cmd].name, sl_cmds[cmd].len);
+    buf[n++] = ' ';
+    n += sl_put_fixed(buf + n, value, scale);
+    return n + sl_end_line(buf + n);
+}
+
+// "SET_EVT <SENSOR> <delta> [<threshold> <hyst>]\n", valores nas unidades do sensor
+static inline size_t sl_encode_set_evt(char *buf, int sensor, int32_t delta, int threshold_enabled, int32_t threshold, int32_t hyst) {
+    int32_t scale = sl_sensors[sensor].scale;
+    size_t n = sl_put_str(buf, sl_cmds[SL_CMD_SET_EVT].name, sl_cmds[SL_CMD_SET_EVT].len);
+
+    buf[n++] = ' ';
+    n += sl_put_str(buf + n, sl_sensors[sensor].wire, sl_sensors[sensor].len);
+    buf[n++] = ' ';
+    n += sl_put_fixed(buf + n, delta, scale);
+    if (threshold_enabled) {
+        buf[n++] = ' ';
+        n += sl_put_fixed(buf + n, threshold, scale);
+        buf[n++] = ' ';
+        n += sl_put_fixed(buf + n, hyst, scale);
+    }
+    return n + sl_end_line(buf + n);
+}
+
+// "SET_BATCH <periodo em ms> <registros por lote>\n", periodo 0 desliga os lotes
+static inline size_t sl_encode_set_batch(char *buf, uint32_t period_ms, uint32_t records) {
+    size_t n = sl_put_str(buf, sl_cmds[SL_CMD_SET_BATCH].name, sl_cmds[SL_CMD_SET_BATCH].len);
+
+    buf[n++] = ' ';
+    n += sl_put_u32(buf + n, period_ms);
+    buf[n++] = ' ';
+    n += sl_put_u32(buf + n, records);
+    return n + sl_end_line(buf + n);
+}
+
+// --- Lotes de amostras ---
+// Com SET_BATCH o firmware le todos os sensores a cada periodo e junta as leituras em uma
+// linha "BAT @<us do primeiro registro> <registros>", enviada quando chega ao numero de
+// registros pedido ou quando a linha enche. Em texto cada amostra custaria uma linha
+// "EVT TEMP 23.50 @123456789" (26 bytes); no lote um registro com os tres sensores
+// costuma ocupar de 4 a 6 bytes.
+//
+// Cada registro tem o intervalo desde o registro anterior e o valor de cada sensor, na
+// ordem de SL_SENSORS. Todo campo eh a diferenca para o mesmo campo do registro anterior
+// (no primeiro registro, para 0), em zigzag (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...) e em
+// varint de 5 bits por caractere: '0' + bits, com SL_BATCH_MORE somado quando o numero
+// continua no caractere seguinte. Os caracteres ficam entre '0' e 'o', entao o lote
+// continua sendo uma linha de texto sem ' ' nem '\n'. Um sensor que nao pode ser lido
+// (DHT com falha, ou sem medida nova desde o registro anterior, ja que o DHT11 so mede a
+// cada 2 s) eh o caractere SL_BATCH_MISSING e o valor anterior continua sendo a
+// referencia do proximo registro.
+
+#define SL_BATCH_DIGIT0 '0'
+#define SL_BATCH_MORE 0x20
+#define SL_BATCH_MISSING '~'
+#define SL_BATCH_RECORD_MAX ((1 + SL_SENSOR_COUNT) * 7) // um int32 em zigzag ocupa ate 7 caracteres
+#define SL_BATCH_MAX_RECORDS 64     // registros por lote pedidos no SET_BATCH
+#define SL_BATCH_MIN_PERIOD_MS 10
+#define SL_BATCH_MAX_PERIOD_MS 60000 // o intervalo em us precisa caber em um int32
+
+// Estado de quem escreve ou le um lote: o ultimo registro, referencia para o proximo
+struct sl_batch {
+    const char *p, *end;            // leitura: proximo registro e fim da linha
+    uint64_t dev_us;                // horario do registro
+    int32_t interval_us;            // intervalo desde o registro anterior
+    int32_t value[SL_SENSOR_COUNT]; // ultimo valor lido de cada sensor
+    uint8_t valid[SL_SENSOR_COUNT]; // sensor lido neste registro
+};
+
+static inline uint32_t sl_zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t sl_unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static inline size_t sl_put_varint(char *p, uint32_t value) {
+    size_t n = 0;
+
+    while (value >= SL_BATCH_MORE) {
+        p[n++] = SL_BATCH_DIGIT0 + SL_BATCH_MORE + (value & (SL_BATCH_MORE - 1));
+        value >>= 5;
+    }
+    p[n++] = SL_BATCH_DIGIT0 + value;
+    return n;
+}
+
+static inline int sl_parse_varint(const char **p, const char *end, uint32_t *out) {
+    uint32_t value = 0, digit;
+    int shift;
+
+    for (shift = 0; shift < 35 && *p < end; shift += 5) {
+        digit = (uint8_t)**p - SL_BATCH_DIGIT0;
+        if (digit >= 2 * SL_BATCH_MORE) return -1;
+        (*p)++;
+        value |= (digit & (SL_BATCH_MORE - 1)) << shift;
+        if (!(digit & SL_BATCH_MORE)) {
+            *out = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Comeca a leitura de uma linha "BAT @<us> <registros>" sem o '\n'.
+// Retorna 0, ou -1 se a linha nao for um lote.
+static inline int sl_batch_begin(struct sl_batch *batch, const char *line, size_t len) {
+    const char *p = line, *end = line + len, *token;
+
+    while (end > p && (end[-1] == '\r' || end[-1] == ' ')) end--;
+    if (sl_token(&p, end, &token) != 3 || memcmp(token, "BAT", 3)) return -1;
+    sl_skip_spaces(&p, end);
+    if (p == end || *p++ != '@') return -1;
+
+    memset(batch, 0, sizeof(*batch));
+    if (sl_parse_u64(&p, end, &batch->dev_us)) return -1;
+    sl_skip_spaces(&p, end);
+    batch->p = p;
+    batch->end = end;
+    return 0;
+}
+
+// Le o proximo registro para batch->dev_us, value e valid.
+// Retorna 1, 0 no fim do lote, ou -1 se o registro estiver cortado ou invalido.
+static inline int sl_batch_next(struct sl_batch *batch) {
+    uint32_t field;
+    int i;
+
+    if (batch->p == batch->end) return 0;
+    if (sl_parse_varint(&batch->p, batch->end, &field)) return -1;
+    batch->interval_us += sl_unzigzag(field);
+    batch->dev_us += (int64_t)batch->interval_us;
+
+    for (i = 0; i < SL_SENSOR_COUNT; i++) {
+        if (batch->p < batch->end && *batch->p == SL_BATCH_MISSING) {
+            batch->p++;
+            batch->valid[i] = 0;
+            continue;
+        }
+        if (sl_parse_varint(&batch->p, batch->end, &field)) return -1;
+        batch->value[i] += sl_unzigzag(field);
+        batch->valid[i] = 1;
+    }
+    return 1;
+}
+
+// --- Decodificacao de respostas e avisos (lado do driver) ---
+
+enum sl_kind {
+    SL_MSG_RES,
+    SL_MSG_ERR,
+    SL_MSG_EVT,
+    SL_MSG_BAT,     // so o horario do primeiro registro, os registros sao lidos com sl_batch_*
+};
+
+struct sl_msg {
+    uint8_t kind;       // enum sl_kind
+    int8_t cmd;         // comando da resposta ou erro, SL_NONE se desconhecido
+    int8_t sensor;      // sensor lido (resposta GET_<SENSOR> ou aviso), SL_NONE se nenhum
+    uint8_t has_value;
+    uint8_t has_time;
+    int32_t value;      // em unidades de 1/escala do sensor
+    uint64_t dev_us;    // horario do firmware; na resposta do GET_TIME eh o proprio valor
+};
+
+// Decodifica uma linha sem o '\n'. Retorna 0, ou -1 se a linha nao for RES/ERR/EVT.
+static inline int sl_parse_line(const char *line, size_t len, struct sl_msg *msg) {
+    const char *p = line, *end = line + len, *token;
+    size_t token_len;
+    int32_t scale = 1;
+
+    while (end > p && (end[-1] == '\r' || end[-1] == ' ')) end--;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->cmd = SL_NONE;
+    msg->sensor = SL_NONE;
+
+    token_len = sl_token(&p, end, &token);
+    if (token_len != 3) return -1;
+    if (!memcmp(token, "RES", 3)) msg->kind = SL_MSG_RES;
+    else if (!memcmp(token, "ERR", 3)) msg->kind = SL_MSG_ERR;
+    else if (!memcmp(token, "EVT", 3)) msg->kind = SL_MSG_EVT;
+    else if (!memcmp(token, "BAT", 3)) msg->kind = SL_MSG_BAT;
+    else return -1;
+
+    if (msg->kind == SL_MSG_BAT) {
+        sl_skip_spaces(&p, end);
+        if (p == end || *p++ != '@' || sl_parse_u64(&p, end, &msg->dev_us)) return -1;
+        msg->has_time = 1;
+        return 0;
+    }
+
+    token_len = sl_token(&p, end, &token);
+    if (msg->kind == SL_MSG_EVT) {
+        msg->sensor = (int8_t)sl_lookup_sensor(token, token_len);
+        if (msg->sensor == SL_NONE) return -1;
+        scale = sl_sensors[msg->sensor].scale;
+    } else {
+        msg->cmd = (int8_t)sl_lookup_cmd(token, token_len);
+        if (msg->cmd == SL_NONE) return msg->kind == SL_MSG_ERR ? 0 : -1; // "ERR <texto>"
+        msg->sensor = sl_cmds[msg->cmd].sensor;
+        scale = sl_cmd_scale(msg->cmd);
+    }
+    if (msg->kind == SL_MSG_ERR) return 0;
+
+    sl_skip_spaces(&p, end);
+    if (msg->cmd == SL_CMD_GET_TIME) {
+        if (sl_parse_u64(&p, end, &msg->dev_us)) return -1;
+        msg->has_time = 1;
+        return 0;
+    }
+    if (sl_parse_fixed(&p, end, scale, &msg->value) == 0) msg->has_value = 1;
+
+    sl_skip_spaces(&p, end);
+    if (p < end && *p == '@') {
+        p++;
+        if (sl_parse_u64(&p, end, &msg->dev_us) == 0) msg->has_time = 1;
+    }
+    return 0;
+}
+
+#ifndef __KERNEL__
+// --- Codificacao de respostas e avisos (lado do firmware) ---
+// O kernel nao precisa delas, e assim nao precisa de divisao de 64 bits.
+
+static inline size_t sl_put_u64(char *p, uint64_t value) {
+    char tmp[20];
+    size_t n = 0, i;
+
+    do {
+        tmp[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    for (i = 0; i < n; i++) p[i] = tmp[n - 1 - i];
+    return n;
+}
+
+// "RES <NOME> <valor>[ @<us>]\n", dev_us = 0 nao escreve o horario
+static inline size_t sl_encode_res(char *buf, int cmd, int32_t value, uint64_t dev_us) {
+    size_t n = sl_put_str(buf, "RES ", 4);
+
+    n += sl_put_str(buf + n, sl_cmds[cmd].name, sl_cmds[cmd].len);
+    buf[n++] = ' ';
+    n += sl_put_fixed(buf + n, value, sl_cmd_scale(cmd));
+    if (dev_us) {
+        buf[n++] = ' ';
+        buf[n++] = '@';
+        n += sl_put_u64(buf + n, dev_us);
+    }
+    return n + sl_end_line(buf + n);
+}
+
+// "RES GET_TIME <us>\n"
+static inline size_t sl_encode_time(char *buf, uint64_t dev_us) {
+    size_t n = sl_put_str(buf, "RES ", 4);
+
+    n += sl_put_str(buf + n, sl_cmds[SL_CMD_GET_TIME].name, sl_cmds[SL_CMD_GET_TIME].len);
+    buf[n++] = ' ';
+    n += sl_put_u64(buf + n, dev_us);
+    return n + sl_end_line(buf + n);
+}
+
+// "ERR <NOME>\n", ou "ERR Unknown command.\n" para SL_NONE
+static inline size_t sl_encode_err(char *buf, int cmd) {
+    size_t n = sl_put_str(buf, "ERR ", 4);
+
+    if (cmd == SL_NONE) n += sl_put_str(buf + n, "Unknown command.", 16);
+    else n += sl_put_str(buf + n, sl_cmds[cmd].name, sl_cmds[cmd].len);
+    return n + sl_end_line(buf + n);
+}
+
+// "EVT <SENSOR> <valor> @<us>\n"
+static inline size_t sl_encode_evt(char *buf, int sensor, int32_t value, uint64_t dev_us) {
+    size_t n = sl_put_str(buf, "EVT ", 4);
+
+    n += sl_put_str(buf + n, sl_sensors[sensor].wire, sl_sensors[sensor].len);
+    buf[n++] = ' ';
+    n += sl_put_fixed(buf + n, value, sl_sensors[sensor].scale);
+    buf[n++] = ' ';
+    buf[n++] = '@';
+    n += sl_put_u64(buf + n, dev_us);
+    return n + sl_end_line(buf + n);
+}
+
+// Comeca um lote em buf (pelo menos SL_MAX_BATCH_LINE bytes): "BAT @<us> ".
+// dev_us eh o horario do primeiro registro.
+static inline size_t sl_batch_start(char *buf, struct sl_batch *batch, uint64_t dev_us) {
+    size_t n = sl_put_str(buf, "BAT @", 5);
+
+    n += sl_put_u64(buf + n, dev_us);
+    buf[n++] = ' ';
+    memset(batch, 0, sizeof(*batch));
+    batch->dev_us = dev_us;
+    return n;
+}
+
+// Escreve um registro em p (ate SL_BATCH_RECORD_MAX caracteres) e devolve o tamanho.
+// valid[i] = 0 marca o sensor i como nao lido.
+static inline size_t sl_batch_put(char *p, struct sl_batch *batch, uint64_t dev_us,
+                                  const int32_t *value, const uint8_t *valid) {
+    int32_t interval = (int32_t)(dev_us - batch->dev_us);
+    size_t n = sl_put_varint(p, sl_zigzag(interval - batch->interval_us));
+    int i;
+
+    batch->dev_us = dev_us;
+    batch->interval_us = interval;
+    for (i = 0; i < SL_SENSOR_COUNT; i++) {
+        batch->valid[i] = valid[i];
+        if (!valid[i]) {
+            p[n++] = SL_BATCH_MISSING;
+            continue;
+        }
+        n += sl_put_varint(p + n, sl_zigzag(value[i] - batch->value[i]));
+        batch->value[i] = value[i];
+    }
+    return n;
+}
+
+// Decodifica um comando recebido pelo firmware (linha sem o '\n').
+// Retorna o comando ou SL_NONE, e em *args o inicio dos argumentos.
+static inline int sl_parse_cmd(const char *line, size_t len, const char **args) {
+    const char *p = line, *end = line + len, *token;
+    size_t token_len;
+
+    while (end > p && (end[-1] == '\r' || end[-1] == ' ')) end--;
+    token_len = sl_token(&p, end, &token);
+    sl_skip_spaces(&p, end);
+    *args = p;
+    return sl_lookup_cmd(token, token_len);
+}
+#endif
+
+#endif // SMARTLAMP_PROTO_H
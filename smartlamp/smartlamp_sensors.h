@@ -0,0 +1,24 @@
+#ifndef SMARTLAMP_SENSORS_H
+#define SMARTLAMP_SENSORS_H
+
+// Tabela de sensores do SmartLamp, compartilhada entre o firmware (smartlamp.ino), o
+// protocolo (smartlamp_proto.h), o driver e a libsmartlamp. Fica separada do protocolo para
+// a libsmartlamp gerar o enum publico dela sem incluir os codificadores.
+//
+// X(ID, nome no sysfs, escala, periodo minimo em ms, leitura no firmware)
+//   escala:  o valor eh guardado como inteiro em unidades de 1/escala (2350 = 23.50)
+//   periodo: intervalo minimo entre duas leituras do hardware nos avisos (o DHT11 nao le
+//            mais rapido que 2 s)
+//   leitura: funcao do firmware "bool leitura(int32_t *value, uint64_t *sampleUs)", com o
+//            valor ja na escala, o horario em que o hardware fez a medida e falso se a
+//            leitura falhou; o driver e a libsmartlamp ignoram esse campo
+//
+// Para adicionar um sensor basta uma linha aqui e a funcao de leitura no firmware: o comando
+// GET_<SENSOR>, o aviso EVT <SENSOR>, o arquivo no sysfs e o SMARTLAMP_<SENSOR> da
+// libsmartlamp sao gerados a partir dela.
+#define SL_SENSORS(X)                    \
+    X(LDR,  "ldr",  1,   100,  ldrRead)  \
+    X(TEMP, "temp", 100, 2000, tempRead) \
+    X(HUM,  "hum",  100, 2000, humRead)
+
+#endif // SMARTLAMP_SENSORS_H